@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h> // getopt()
+
+/*
+ * benchmark driver for the engines. Every variant is run as its own
+ * process over a sweep of thread counts: [warmup] runs are thrown away,
+ * then [reps] runs are timed. A run's time is the "Execution time" the
+ * program reports itself (steady_clock, setup excluded), falling back to
+ * the wall time of the whole process if it prints none.
+ *
+ * The summary goes to stdout as JSON, progress to stderr.
+ */
+
+struct Variant
+{
+	const char * name;
+	const char * command;   // run as: command [args] thread_count
+
+	const char * unit;      // what the throughput counts
+	double work;            // units per run, unless...
+	bool reports_ops;       // ...parsed from "N operations completed"
+};
+
+const Variant VARIANTS[] =
+{
+	{ "prime", "./prime -m pool", "integers", 1e8, false },
+	{ "prime-rev1", "./prime-rev1", "integers", 1e8, false },
+	{ "prime-rev3", "./prime-rev3", "integers", 1e7, false },
+	{ "stack", "./stack", "operations", 0, true },
+	{ "stack1", "./stack1", "operations", 0, true },
+};
+
+struct Run
+{
+	double ms;
+	double work;
+};
+
+/* run [command] once, false if it couldn't be started or failed */
+bool run_once(const Variant & v, const std::string & command, Run & run)
+{
+	using namespace std::chrono;
+
+	auto start_time = steady_clock::now();
+
+	FILE * out = popen((command + " 2>&1").c_str(), "r");
+	if (out == nullptr) return false;
+
+	run.ms = -1;
+	run.work = v.work;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), out))
+	{
+		double value;
+		if (sscanf(line, "Execution time: %lfms", &value) == 1)
+			run.ms = value;
+
+		if (v.reports_ops && sscanf(line, "%lf operations completed", &value) == 1)
+			run.work = value;
+	}
+
+	int status = pclose(out);
+
+	if (run.ms < 0)
+		run.ms = duration_cast<nanoseconds>(steady_clock::now() - start_time).count() / 1e6;
+
+	return status == 0;
+}
+
+/* nearest rank percentile of sorted [values] */
+double percentile(const std::vector<double> & values, double p)
+{
+	size_t rank = (size_t) (p / 100 * values.size() + 0.999999);
+	rank = std::min(std::max<size_t>(rank, 1), values.size());
+	return values[rank - 1];
+}
+
+void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-w warmup] [-n repetitions] [-t threads,threads,...] "
+			"[variant ...]\nvariants:", name);
+	for (const Variant & v : VARIANTS)
+		fprintf(stderr, " %s", v.name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+	int warmup = 1;
+	int reps = 5;
+	std::vector<int> sweep = { 1, 2, 4, 8 };
+
+	int opt;
+	while ((opt = getopt(argc, argv, "w:n:t:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'w': warmup = atoi(optarg); break;
+			case 'n': reps = atoi(optarg); break;
+			case 't':
+				sweep.clear();
+				for (char * t = strtok(optarg, ","); t; t = strtok(nullptr, ","))
+					sweep.push_back(atoi(t));
+				break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (reps < 1 || sweep.empty()) usage(argv[0]);
+
+	std::vector<const Variant *> selected;
+	for (int i = optind; i < argc; i++)
+	{
+		const Variant * found = nullptr;
+		for (const Variant & v : VARIANTS)
+		{
+			if (strcmp(argv[i], v.name) == 0) found = &v;
+		}
+		if (found == nullptr) usage(argv[0]);
+
+		selected.push_back(found);
+	}
+
+	if (selected.empty())
+	{
+		for (const Variant & v : VARIANTS)
+			selected.push_back(&v);
+	}
+
+	printf("{\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"results\": [", warmup, reps);
+
+	bool first = true;
+	for (const Variant * v : selected)
+	{
+		for (int threads : sweep)
+		{
+			std::string command = std::string(v->command) + " " + std::to_string(threads);
+			fprintf(stderr, "%s ...\n", command.c_str());
+
+			Run run;
+			bool ok = true;
+			for (int i = 0; i < warmup && ok; i++)
+				ok = run_once(*v, command, run);
+
+			std::vector<double> times;
+			double work = 0;
+			for (int i = 0; i < reps && ok; i++)
+			{
+				ok = run_once(*v, command, run);
+				times.push_back(run.ms);
+				work += run.work;
+			}
+
+			printf("%s\n    { \"variant\": \"%s\", \"threads\": %d, ", first ? "" : ",",
+					v->name, threads);
+			first = false;
+
+			if (!ok)
+			{
+				printf("\"error\": \"run failed\" }");
+				continue;
+			}
+
+			std::sort(times.begin(), times.end());
+
+			double median = times.size() % 2 ? times[times.size() / 2]
+				: (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+
+			// throughput at the median run, for the average amount of work
+			double throughput = median > 0 ? work / reps / (median / 1000) : 0;
+
+			printf("\"median_ms\": %.3f, \"p99_ms\": %.3f, \"min_ms\": %.3f, "
+					"\"max_ms\": %.3f, \"throughput\": %.1f, \"unit\": \"%s/s\" }",
+					median, percentile(times, 99), times.front(), times.back(),
+					throughput, v->unit);
+		}
+	}
+
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
@@ -0,0 +1,163 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <new>
+
+#include <cstdint>
+#include <cstring>
+
+#include "pages.h"
+
+typedef unsigned long int prime_t;
+
+/*
+ * composite table over [0, range) that only stores the odd numbers, one bit
+ * each (bit set = composite). Even numbers are implicitly composite, apart
+ * from 2 which every query special cases.
+ *
+ * 1 and the padding bits past the end of the range are pre-marked as
+ * composite, so a popcount over the whole words is the prime count.
+ */
+class OddBitmap
+{
+	prime_t range;
+	prime_t word_count;
+	uint64_t * words;
+
+	// set when the words come from map_pages() rather than new
+	bool mapped;
+	PageMode page_mode;
+
+	public:
+
+	// integers covered by a single word (64 odd numbers)
+	static const prime_t WORD_SPAN = 128;
+
+	OddBitmap(prime_t _range)
+	{
+		range = _range;
+		word_count = (range + WORD_SPAN - 1) / WORD_SPAN;
+		words = new uint64_t[word_count];
+		mapped = false;
+		page_mode = SMALL_PAGES;
+
+		clear();
+	}
+
+	/*
+	 * same, but backed by mmap'd pages that are left untouched (zero), so
+	 * whichever thread first writes a region places it. 1 and the padding
+	 * are NOT marked, the caller has to clear() or stamp every word.
+	 */
+	OddBitmap(prime_t _range, PageMode mode)
+	{
+		range = _range;
+		word_count = (range + WORD_SPAN - 1) / WORD_SPAN;
+		page_mode = mode;
+		words = (uint64_t *) map_pages(word_count * sizeof(uint64_t), page_mode);
+		mapped = true;
+
+		if (words == nullptr) throw std::bad_alloc();
+	}
+
+	OddBitmap(const OddBitmap &) = delete;
+	OddBitmap & operator=(const OddBitmap &) = delete;
+
+	/* reset to "everything is prime" (apart from 1 and the padding) */
+	void clear()
+	{
+		memset(words, 0, word_count * sizeof(uint64_t));
+
+		// 1 is not a prime
+		words[0] |= 1;
+
+		mark_padding();
+	}
+
+	/* mark the bits past the end of the range */
+	void mark_padding()
+	{
+		for (prime_t n = range | 1; n < word_count * WORD_SPAN; n += 2)
+			words[n / WORD_SPAN] |= bit(n);
+	}
+
+	static uint64_t bit(prime_t n)
+	{
+		return uint64_t(1) << ((n >> 1) & 63);
+	}
+
+	/* plain accessors, for words owned by the calling thread */
+	bool get(prime_t n) const
+	{
+		if (n % 2 == 0) return n != 2;
+		return words[n / WORD_SPAN] & bit(n);
+	}
+
+	void set(prime_t n)
+	{
+		words[n / WORD_SPAN] |= bit(n);
+	}
+
+	/* relaxed atomic accessors, for words other threads are writing to */
+	bool get_atomic(prime_t n) const
+	{
+		if (n % 2 == 0) return n != 2;
+		return __atomic_load_n(words + n / WORD_SPAN, __ATOMIC_RELAXED) & bit(n);
+	}
+
+	void set_atomic(prime_t n)
+	{
+		__atomic_fetch_or(words + n / WORD_SPAN, bit(n), __ATOMIC_RELAXED);
+	}
+
+	/* number of primes in [0, range) */
+	prime_t count() const
+	{
+		prime_t total = range > 2 ? 1 : 0;
+		for (prime_t i = 0; i < word_count; i++)
+			total += __builtin_popcountll(~words[i]);
+
+		return total;
+	}
+
+	/* largest prime below n, or 0 if there is none */
+	prime_t prev_prime(prime_t n) const
+	{
+		if (n > range) n = range;
+		if (n <= 3) return n == 3 ? 2 : 0;
+
+		// last odd number below n
+		prime_t last = (n - 1) | 1;
+		if (last >= n) last -= 2;
+
+		prime_t w = last / WORD_SPAN;
+		int b = (last >> 1) & 63;
+
+		// hide the bits above [last] in its word
+		uint64_t primes = ~words[w] & (~uint64_t(0) >> (63 - b));
+		for (;;)
+		{
+			if (primes != 0)
+				return w * WORD_SPAN + 2 * (63 - __builtin_clzll(primes)) + 1;
+
+			if (w == 0) return 2;
+			primes = ~words[--w];
+		}
+	}
+
+	prime_t get_range() const { return range; }
+	prime_t size() const { return word_count; }
+	uint64_t * data() { return words; }
+	const uint64_t * data() const { return words; }
+
+	/* how the words were actually allocated (huge pages may have fallen back) */
+	PageMode get_page_mode() const { return page_mode; }
+
+	~OddBitmap()
+	{
+		if (mapped) unmap_pages(words, word_count * sizeof(uint64_t), page_mode);
+		else delete [] words;
+	}
+};
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef ELIMINATION_H
+#define ELIMINATION_H
+
+#include <atomic>
+
+#include <cstdint>
+
+/*
+ * elimination array to put in front of a lock-free stack. A push whose CAS
+ * on the head failed offers its node in a random slot and waits there a
+ * little, a pop whose CAS failed looks in a random slot for an offer and
+ * takes it. A push and a pop that meet cancel out without touching the
+ * head, so the more threads collide on it the more of them get through
+ * here instead.
+ *
+ * Both knobs follow the contention the slots see: the part of the array in
+ * use widens when an offer finds its slot busy and narrows when an offer
+ * times out alone, and the wait grows when offers get taken and shrinks
+ * when they don't. The updates are racy on purpose, they're only hints.
+ */
+template <class Node>
+class EliminationArray
+{
+	static const int MAX_WIDTH = 16;
+
+	// pause iterations a push waits for a pop
+	static const int MIN_WAIT = 16;
+	static const int MAX_WAIT = 1024;
+
+	struct alignas(64) Slot
+	{
+		std::atomic<Node *> offer { nullptr };
+	};
+
+	Slot slots[MAX_WIDTH];
+
+	std::atomic<int> width { 1 };
+	std::atomic<int> wait { MIN_WAIT };
+
+	std::atomic<long> eliminated { 0 };
+
+	/* what a pop leaves in the slot it took an offer from */
+	static Node * taken()
+	{
+		return reinterpret_cast<Node *>(uintptr_t(1));
+	}
+
+	Slot & pick()
+	{
+		// xorshift, rand() takes a lock
+		static thread_local uint32_t seed = 2463534242u
+			^ (uint32_t) reinterpret_cast<uintptr_t>(&seed);
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		return slots[seed % width.load(std::memory_order_relaxed)];
+	}
+
+	static void adapt(std::atomic<int> & knob, int value, int lo, int hi)
+	{
+		knob.store(value < lo ? lo : value > hi ? hi : value, std::memory_order_relaxed);
+	}
+
+	public:
+
+	/* offer [node] to a pop for a while, true if one took it */
+	bool push(Node * node)
+	{
+		Slot & slot = pick();
+
+		Node * expected = nullptr;
+		if (!slot.offer.compare_exchange_strong(expected, node, std::memory_order_release,
+					std::memory_order_relaxed))
+		{
+			// somebody's there already, spread out
+			adapt(width, width.load(std::memory_order_relaxed) + 1, 1, MAX_WIDTH);
+			return false;
+		}
+
+		int limit = wait.load(std::memory_order_relaxed);
+		for (int i = 0; i < limit; i++)
+		{
+			if (slot.offer.load(std::memory_order_acquire) == taken())
+			{
+				slot.offer.store(nullptr, std::memory_order_release);
+				adapt(wait, limit * 2, MIN_WAIT, MAX_WAIT);
+				return true;
+			}
+
+			__builtin_ia32_pause();
+		}
+
+		// withdraw, unless a pop got it in the meantime
+		expected = node;
+		if (slot.offer.compare_exchange_strong(expected, nullptr, std::memory_order_relaxed))
+		{
+			adapt(width, width.load(std::memory_order_relaxed) - 1, 1, MAX_WIDTH);
+			adapt(wait, limit / 2, MIN_WAIT, MAX_WAIT);
+			return false;
+		}
+
+		slot.offer.store(nullptr, std::memory_order_release);
+		return true;
+	}
+
+	/* a node some push is offering, nullptr if there was none to take */
+	Node * pop()
+	{
+		Slot & slot = pick();
+
+		Node * offered = slot.offer.load(std::memory_order_acquire);
+		if (offered == nullptr || offered == taken())
+			return nullptr;
+
+		if (!slot.offer.compare_exchange_strong(offered, taken(), std::memory_order_acq_rel,
+					std::memory_order_relaxed))
+			return nullptr;
+
+		eliminated.fetch_add(1, std::memory_order_relaxed);
+		return offered;
+	}
+
+	/* push / pop pairs that met here */
+	long getEliminated() const
+	{
+		return eliminated.load(std::memory_order_relaxed);
+	}
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <algorithm>
+#include <vector>
+
+#include <cmath>
+#include <cstdint>
+
+#include "bitmap.h"
+
+/*
+ * sieve whose bound can grow. It keeps its odd-only bitmap (bit set =
+ * composite), the odd base primes found so far and the next odd multiple
+ * each one still has to cross off, so extend(new_hi) only sieves the new
+ * segments: old base primes resume where they stopped, new ones start at
+ * p^2, which is past everything sieved before.
+ *
+ * Internally the bitmap always ends on a whole word, queries are limited to
+ * [0, hi).
+ */
+class IncrementalSieve
+{
+	prime_t hi;
+
+	// integers per segment of an extension (a multiple of 128)
+	prime_t segment_size;
+
+	std::vector<uint64_t> words;
+	prime_t sieved;
+
+	// odd base primes up to sqrt(sieved), and where each one resumes
+	std::vector<prime_t> base_primes;
+	std::vector<prime_t> next_multiple;
+	prime_t base_limit;
+
+	// odd primes in [0, sieved)
+	prime_t odd_count;
+
+	public:
+
+	IncrementalSieve(prime_t _hi = 0, prime_t _segment_size = 256 * 1024)
+	{
+		hi = 0;
+		segment_size = std::max<prime_t>(_segment_size / OddBitmap::WORD_SPAN, 1)
+			* OddBitmap::WORD_SPAN;
+		sieved = 0;
+		base_limit = 2;
+		odd_count = 0;
+
+		extend(_hi);
+	}
+
+	/* grow the sieve to cover [0, new_hi), a smaller bound is a no-op */
+	void extend(prime_t new_hi)
+	{
+		if (new_hi <= hi) return;
+
+		prime_t target = (new_hi + OddBitmap::WORD_SPAN - 1)
+			/ OddBitmap::WORD_SPAN * OddBitmap::WORD_SPAN;
+
+		if (target > sieved)
+		{
+			prime_t first = sieved / OddBitmap::WORD_SPAN;
+			words.resize(target / OddBitmap::WORD_SPAN, 0);
+
+			// 1 is not a prime
+			if (first == 0) words[0] |= 1;
+
+			add_base_primes(isqrt(target - 1));
+
+			for (prime_t lo = sieved; lo < target; lo += segment_size)
+				sieve_segment(std::min(lo + segment_size, target));
+
+			for (prime_t w = first; w < words.size(); w++)
+				odd_count += __builtin_popcountll(~words[w]);
+
+			sieved = target;
+		}
+
+		hi = new_hi;
+	}
+
+	prime_t get_hi() const { return hi; }
+
+	bool is_prime(prime_t n) const
+	{
+		if (n % 2 == 0) return n == 2 && hi > 2;
+		if (n >= hi) return false;
+
+		return !(words[n / OddBitmap::WORD_SPAN] & OddBitmap::bit(n));
+	}
+
+	/* number of primes in [0, hi) */
+	prime_t count() const
+	{
+		if (hi <= 2) return 0;
+
+		// take back the odd primes sieved past hi, all in the last word
+		prime_t total = 1 + odd_count;
+		for (prime_t n = hi | 1; n < sieved; n += 2)
+			total -= is_prime_bit(n);
+
+		return total;
+	}
+
+	/* base primes kept around for the next extension */
+	size_t base_prime_count() const { return base_primes.size(); }
+
+	private:
+
+	static prime_t isqrt(prime_t x)
+	{
+		prime_t r = (prime_t) sqrtl((long double) x);
+		while (r * r > x) r--;
+		while ((r + 1) * (r + 1) <= x) r++;
+		return r;
+	}
+
+	bool is_prime_bit(prime_t n) const
+	{
+		return !(words[n / OddBitmap::WORD_SPAN] & OddBitmap::bit(n));
+	}
+
+	/*
+	 * collect the odd primes in (base_limit, root]. Whatever is below the
+	 * old bound is read off the bitmap, anything past it gets a small
+	 * sieve of its own
+	 */
+	void add_base_primes(prime_t root)
+	{
+		if (root <= base_limit) return;
+
+		std::vector<bool> is_composite;
+		if (root >= sieved)
+		{
+			is_composite.assign(root + 1, false);
+			for (prime_t p = 3; p * p <= root; p += 2)
+			{
+				if (is_composite[p]) continue;
+				for (prime_t i = p * p; i <= root; i += 2 * p)
+					is_composite[i] = true;
+			}
+		}
+
+		for (prime_t n = (base_limit + 1) | 1; n <= root; n += 2)
+		{
+			bool prime = n < sieved ? is_prime_bit(n) : !is_composite[n];
+			if (!prime) continue;
+
+			// everything below p^2 >= the old bound is already done
+			base_primes.push_back(n);
+			next_multiple.push_back(n * n);
+		}
+
+		base_limit = root;
+	}
+
+	/* run every started base prime up to seg_hi */
+	void sieve_segment(prime_t seg_hi)
+	{
+		for (size_t i = 0; i < base_primes.size(); i++)
+		{
+			prime_t p = base_primes[i];
+
+			// the rest haven't started yet
+			if (p * p >= seg_hi) break;
+
+			prime_t m = next_multiple[i];
+			for (; m < seg_hi; m += 2 * p)
+				words[m / OddBitmap::WORD_SPAN] |= OddBitmap::bit(m);
+
+			next_multiple[i] = m;
+		}
+	}
+};
+
+#endif
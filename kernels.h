@@ -0,0 +1,104 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <array>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "bitmap.h"
+
+/*
+ * crossing off kernels for the odd primes below 64, one per prime, all
+ * generated at compile time.
+ *
+ * In the odd-only bitmap the odd multiples of an odd P repeat every P
+ * words, so the whole job is OR-ing a constexpr P word pattern over the
+ * bitmap, P words per fixed trip count iteration, instead of a bit at a
+ * time with a runtime stride. The pattern also marks P itself, the caller
+ * has to unmark it in word 0 (and everything between P and P^2 it marks is
+ * composite anyway).
+ */
+namespace kernels
+{
+	/* pattern[w] has bit b set when 128 w + 2 b + 1 is a multiple of P */
+	template <prime_t P>
+	constexpr std::array<uint64_t, P> pattern()
+	{
+		std::array<uint64_t, P> words {};
+		for (prime_t w = 0; w < P; w++)
+		{
+			for (prime_t b = 0; b < 64; b++)
+			{
+				if ((w * OddBitmap::WORD_SPAN + 2 * b + 1) % P == 0)
+					words[w] |= uint64_t(1) << b;
+			}
+		}
+
+		return words;
+	}
+
+	/* or the multiples of P into words [first, first + count) */
+	template <prime_t P>
+	void cross_off(uint64_t * words, prime_t first, prime_t count)
+	{
+		static constexpr std::array<uint64_t, P> PATTERN = pattern<P>();
+
+		uint64_t * w = words + first;
+		uint64_t * end = w + count;
+
+		// line up with the pattern, then whole periods
+		for (prime_t phase = first % P; phase != 0 && w < end; phase = (phase + 1) % P)
+			*w++ |= PATTERN[phase];
+
+		for (; end - w >= (ptrdiff_t) P; w += P)
+		{
+			for (prime_t i = 0; i < P; i++)
+				w[i] |= PATTERN[i];
+		}
+
+		for (prime_t i = 0; w < end; i++)
+			*w++ |= PATTERN[i];
+	}
+
+	typedef void (*Kernel)(uint64_t *, prime_t, prime_t);
+
+	// primes the table has a kernel for are the odd ones below this
+	const prime_t LIMIT = 64;
+
+	/* TABLE[p] is p's kernel, nullptr for anything that isn't an odd prime */
+	struct Table
+	{
+		Kernel kernels[LIMIT] = {};
+
+		constexpr Table()
+		{
+			kernels[3] = cross_off<3>;
+			kernels[5] = cross_off<5>;
+			kernels[7] = cross_off<7>;
+			kernels[11] = cross_off<11>;
+			kernels[13] = cross_off<13>;
+			kernels[17] = cross_off<17>;
+			kernels[19] = cross_off<19>;
+			kernels[23] = cross_off<23>;
+			kernels[29] = cross_off<29>;
+			kernels[31] = cross_off<31>;
+			kernels[37] = cross_off<37>;
+			kernels[41] = cross_off<41>;
+			kernels[43] = cross_off<43>;
+			kernels[47] = cross_off<47>;
+			kernels[53] = cross_off<53>;
+			kernels[59] = cross_off<59>;
+			kernels[61] = cross_off<61>;
+		}
+
+		Kernel operator[](prime_t p) const
+		{
+			return p < LIMIT ? kernels[p] : nullptr;
+		}
+	};
+
+	inline constexpr Table TABLE;
+}
+
+#endif
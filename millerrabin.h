@@ -0,0 +1,132 @@
+#ifndef MILLERRABIN_H
+#define MILLERRABIN_H
+
+#include <cstdint>
+
+#include "pool.h"
+
+/*
+ * arithmetic mod an odd n < 2^64 in Montgomery form (R = 2^64), so a
+ * modular multiply is two 64x64->128 multiplies and no division.
+ */
+struct Montgomery
+{
+	uint64_t n;
+	uint64_t inv; // n^-1 mod 2^64
+	uint64_t r2;  // R^2 mod n
+
+	uint64_t one;
+	uint64_t minus_one;
+
+	Montgomery(uint64_t _n) : n(_n)
+	{
+		// newton iteration, every step doubles the correct low bits
+		inv = n;
+		for (int i = 0; i < 5; i++)
+			inv *= 2 - n * inv;
+
+		uint64_t r = -n % n;
+		r2 = (unsigned __int128) r * r % n;
+
+		one = r;
+		minus_one = n - r;
+	}
+
+	/* t * R^-1 mod n, for t < n * R */
+	uint64_t reduce(unsigned __int128 t) const
+	{
+		uint64_t m = (uint64_t) t * inv;
+		uint64_t t_hi = t >> 64;
+		uint64_t mn_hi = ((unsigned __int128) m * n) >> 64;
+
+		// the low halves cancel exactly
+		return t_hi >= mn_hi ? t_hi - mn_hi : t_hi - mn_hi + n;
+	}
+
+	uint64_t mul(uint64_t a, uint64_t b) const
+	{
+		return reduce((unsigned __int128) a * b);
+	}
+
+	uint64_t to_mont(uint64_t a) const
+	{
+		return mul(a % n, r2);
+	}
+
+	uint64_t pow(uint64_t a, uint64_t e) const
+	{
+		uint64_t result = one;
+		for (; e > 0; e >>= 1)
+		{
+			if (e & 1) result = mul(result, a);
+			a = mul(a, a);
+		}
+
+		return result;
+	}
+};
+
+/*
+ * deterministic Miller-Rabin for every 64-bit n. The seven bases are
+ * Jim Sinclair's set, which has no strong pseudoprime below 2^64.
+ */
+inline bool is_prime_mr(uint64_t n)
+{
+	const uint64_t small[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+	const uint64_t bases[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+
+	if (n < 2) return false;
+	for (uint64_t p : small)
+	{
+		if (n % p == 0) return n == p;
+	}
+	if (n < 41 * 41) return true;
+
+	Montgomery mont(n);
+
+	uint64_t d = n - 1;
+	int s = __builtin_ctzll(d);
+	d >>= s;
+
+	for (uint64_t a : bases)
+	{
+		uint64_t x = mont.to_mont(a);
+		if (x == 0) continue; // a is a multiple of n
+
+		x = mont.pow(x, d);
+		if (x == mont.one || x == mont.minus_one) continue;
+
+		bool witness = true;
+		for (int r = 1; r < s && witness; r++)
+		{
+			x = mont.mul(x, x);
+			witness = x != mont.minus_one;
+		}
+
+		if (witness) return false;
+	}
+
+	return true;
+}
+
+/*
+ * is_prime[i] = is_prime_mr(n[i]) for a whole array, cut into [chunk]
+ * sized tasks on the pool
+ */
+inline void is_prime_mr_batch(const uint64_t * n, size_t count, bool * is_prime,
+		WorkPool & pool, size_t chunk = 4096)
+{
+	for (size_t lo = 0; lo < count; lo += chunk)
+	{
+		size_t hi = lo + chunk < count ? lo + chunk : count;
+		pool.submit([=](int)
+		{
+			for (size_t i = lo; i < hi; i++)
+				is_prime[i] = is_prime_mr(n[i]);
+		});
+	}
+
+	pool.wait();
+}
+
+#endif
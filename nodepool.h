@@ -0,0 +1,205 @@
+#ifndef NODEPOOL_H
+#define NODEPOOL_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+
+// threads that can use a pool (or a hazard / epoch stack) at once
+const int MAX_THREADS = 256;
+
+/*
+ * small per-thread index into per-thread slot arrays, claimed on first
+ * use and released when the thread exits
+ */
+struct ThreadSlot
+{
+	static inline std::atomic<bool> used[MAX_THREADS];
+
+	int id;
+
+	ThreadSlot()
+	{
+		for (id = 0; id < MAX_THREADS; id++)
+		{
+			bool expected = false;
+			if (!used[id].load(std::memory_order_relaxed)
+					&& used[id].compare_exchange_strong(expected, true))
+				return;
+		}
+
+		fprintf(stderr, "more than %d threads on a stack\n", MAX_THREADS);
+		abort();
+	}
+
+	~ThreadSlot()
+	{
+		used[id].store(false, std::memory_order_release);
+	}
+
+	static int get()
+	{
+		static thread_local ThreadSlot slot;
+		return slot.id;
+	}
+};
+
+/*
+ * concurrent allocator for stack nodes (anything with a [next] pointer),
+ * which takes them back for reuse.
+ *
+ * Every thread keeps a free list of its own, so get() and put() are a
+ * couple of pointer moves. A list that grows past two batches hands one
+ * batch to the depot, a list that runs dry takes one from it, and only
+ * when the depot is empty too is a new slab allocated. Slabs go back to
+ * the heap with the pool, so the memory a node was stays a Node while the
+ * pool lives (a stale read of a recycled node reads a Node).
+ *
+ * The depot is an array of slots holding a whole batch each: a batch goes
+ * in with a CAS from nullptr, and comes out with an exchange to nullptr,
+ * which can't be fooled by ABA the way a list head can.
+ */
+template <class Node>
+class NodePool
+{
+	// nodes moved to / from the depot at once
+	static const int BATCH = 64;
+	static const int DEPOT_SLOTS = 64;
+
+	// nodes per allocation
+	static const int SLAB = 16 * BATCH;
+
+	struct alignas(64) Cache
+	{
+		Node * free = nullptr;
+		int count = 0;
+	};
+
+	Cache caches[MAX_THREADS];
+
+	std::atomic<Node *> depot[DEPOT_SLOTS];
+
+	// only touched on a slab allocation
+	std::mutex slab_lock;
+	std::vector<Node *> slabs;
+
+	public:
+
+	NodePool()
+	{
+		for (auto & slot : depot)
+			slot.store(nullptr, std::memory_order_relaxed);
+	}
+
+	Node * get(const decltype(Node::val) & val)
+	{
+		Cache & cache = caches[ThreadSlot::get()];
+		if (cache.count == 0) refill(cache);
+
+		Node * node = cache.free;
+		cache.free = node->next;
+		cache.count--;
+
+		node->val = val;
+		return node;
+	}
+
+	/* [node] must not be reachable by anyone anymore */
+	void put(Node * node)
+	{
+		Cache & cache = caches[ThreadSlot::get()];
+
+		node->next = cache.free;
+		cache.free = node;
+		cache.count++;
+
+		// (a full depot is only tried again a batch later)
+		if (cache.count >= 2 * BATCH && cache.count % BATCH == 0) spill(cache);
+	}
+
+	/* nodes allocated so far, free or not */
+	long allocated()
+	{
+		std::lock_guard<std::mutex> lock(slab_lock);
+		return (long) slabs.size() * SLAB;
+	}
+
+	~NodePool()
+	{
+		for (Node * slab : slabs)
+			delete [] slab;
+	}
+
+	private:
+
+	/* a batch from the depot, or a new slab */
+	void refill(Cache & cache)
+	{
+		int start = ThreadSlot::get() % DEPOT_SLOTS;
+		for (int i = 0; i < DEPOT_SLOTS; i++)
+		{
+			std::atomic<Node *> & slot = depot[(start + i) % DEPOT_SLOTS];
+			if (slot.load(std::memory_order_relaxed) == nullptr) continue;
+
+			if (Node * batch = slot.exchange(nullptr, std::memory_order_acquire))
+			{
+				cache.free = batch;
+				cache.count = BATCH;
+				return;
+			}
+		}
+
+		Node * slab = new Node[SLAB];
+		{
+			std::lock_guard<std::mutex> lock(slab_lock);
+			slabs.push_back(slab);
+		}
+
+		for (int i = 0; i < SLAB - 1; i++)
+			slab[i].next = slab + i + 1;
+		slab[SLAB - 1].next = nullptr;
+
+		cache.free = slab;
+		cache.count = SLAB;
+
+		// keep one batch, the rest goes where other threads can get at it
+		while (cache.count > BATCH && spill(cache));
+	}
+
+	/* hand the top batch to the depot, false if it's full */
+	bool spill(Cache & cache)
+	{
+		Node * batch = cache.free;
+		Node * last = batch;
+		for (int i = 1; i < BATCH; i++)
+			last = last->next;
+
+		Node * rest = last->next;
+		last->next = nullptr;
+
+		int start = ThreadSlot::get() % DEPOT_SLOTS;
+		for (int i = 0; i < DEPOT_SLOTS; i++)
+		{
+			std::atomic<Node *> & slot = depot[(start + i) % DEPOT_SLOTS];
+
+			Node * expected = nullptr;
+			if (slot.load(std::memory_order_relaxed) == nullptr
+					&& slot.compare_exchange_strong(expected, batch, std::memory_order_release,
+						std::memory_order_relaxed))
+			{
+				cache.free = rest;
+				cache.count -= BATCH;
+				return true;
+			}
+		}
+
+		// keep it then, the list just stays longer
+		last->next = rest;
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef PAGES_H
+#define PAGES_H
+
+#include <map>
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * page level control over the big sieve buffers.
+ *
+ * Memory comes straight from mmap, so nothing touches it until the sieve
+ * does: on a NUMA box the kernel places each page on the node of the first
+ * thread to write it, and with huge pages one fault maps 2 MB instead of
+ * 4 KB. A huge page is also the placement granularity, so first touch only
+ * pays off for regions of at least that size per thread.
+ */
+enum PageMode { SMALL_PAGES, TRANSPARENT_HUGE_PAGES, HUGETLB_PAGES, PAGE_MODE_COUNT };
+inline const char * PAGE_MODE_NAMES[] = { "small", "thp", "hugetlb" };
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/*
+ * [bytes] of untouched, zero filled memory. MAP_HUGETLB needs pages reserved
+ * in /proc/sys/vm/nr_hugepages, without them [mode] falls back to
+ * transparent huge pages (and reports so).
+ */
+inline void * map_pages(size_t bytes, PageMode & mode)
+{
+	if (mode == HUGETLB_PAGES)
+	{
+		size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		void * p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) return p;
+
+		mode = TRANSPARENT_HUGE_PAGES;
+	}
+
+	void * p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return nullptr;
+
+	// only a hint, the kernel may still hand out small pages
+	if (mode == TRANSPARENT_HUGE_PAGES) madvise(p, bytes, MADV_HUGEPAGE);
+
+	return p;
+}
+
+inline void unmap_pages(void * p, size_t bytes, PageMode mode)
+{
+	if (mode == HUGETLB_PAGES)
+		bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+	munmap(p, bytes);
+}
+
+/* pin [thread] to the [index]-th cpu the process is allowed on (wrapping) */
+inline bool pin_thread(int index, pthread_t thread = pthread_self())
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+
+	int count = CPU_COUNT(&allowed);
+	if (count == 0) return false;
+
+	int target = index % count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+	}
+
+	return false;
+}
+
+/*
+ * print which NUMA node each page of [p, p + bytes) ended up on. Uses
+ * move_pages(2) with no target nodes, which only queries
+ */
+inline void report_placement(const void * p, size_t bytes)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+
+	std::vector<void *> pages;
+	for (size_t offset = 0; offset < bytes; offset += page)
+		pages.push_back((char *) p + offset);
+
+	std::vector<int> status(pages.size(), -1);
+	long ok = syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr,
+			status.data(), 0);
+
+	printf("Page placement (%zu pages):", pages.size());
+	if (ok != 0)
+	{
+		printf(" unavailable\n");
+		return;
+	}
+
+	// negative status is an errno, e.g. a page that was never touched
+	std::map<int, size_t> per_node;
+	for (int node : status)
+		per_node[node < 0 ? -1 : node]++;
+
+	for (auto & entry : per_node)
+	{
+		if (entry.first < 0) printf(" untouched %zu", entry.second);
+		else printf(" node%d %zu", entry.first, entry.second);
+	}
+	printf("\n");
+}
+
+#endif
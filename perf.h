@@ -0,0 +1,132 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * thin wrapper over perf_event_open(2) for counting hardware events across
+ * the whole process. Counters are opened on the calling thread with inherit
+ * set, so threads spawned afterwards are counted too (their counts land once
+ * they are joined).
+ *
+ * Counters the kernel or cpu refuse (containers, perf_event_paranoid, ...)
+ * are silently dropped and reported as unavailable.
+ */
+class PerfCounters
+{
+	struct Counter
+	{
+		const char * name;
+		int fd;
+		uint64_t value;
+	};
+
+	std::vector<Counter> counters;
+
+	public:
+
+	static uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result)
+	{
+		return cache | (op << 8) | (result << 16);
+	}
+
+	/* the default set, the miss counts mostly come from lines bouncing between cores */
+	PerfCounters()
+	{
+		add("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		add("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		add("cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+		add("cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+		add("L1d-load-misses", PERF_TYPE_HW_CACHE, cache_event(
+					PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+					PERF_COUNT_HW_CACHE_RESULT_MISS));
+		add("LLC-store-misses", PERF_TYPE_HW_CACHE, cache_event(
+					PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_WRITE,
+					PERF_COUNT_HW_CACHE_RESULT_MISS));
+	}
+
+	PerfCounters(const PerfCounters &) = delete;
+	PerfCounters & operator=(const PerfCounters &) = delete;
+
+	void add(const char * name, uint32_t type, uint64_t config)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		counters.push_back({ name, fd, 0 });
+	}
+
+	void start()
+	{
+		for (Counter & c : counters)
+		{
+			if (c.fd < 0) continue;
+			ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	void stop()
+	{
+		for (Counter & c : counters)
+		{
+			if (c.fd < 0) continue;
+			ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(c.fd, &c.value, sizeof(c.value)) != sizeof(c.value))
+				c.value = 0;
+		}
+	}
+
+	/* value of the named counter, or -1 if it couldn't be opened */
+	long long get(const char * name) const
+	{
+		for (const Counter & c : counters)
+		{
+			if (strcmp(c.name, name) == 0)
+				return c.fd < 0 ? -1 : (long long) c.value;
+		}
+
+		return -1;
+	}
+
+	/* print every counter, scaled per [units] of work */
+	void report(double units, const char * unit_name) const
+	{
+		printf("Perf counters (per %s):\n", unit_name);
+		for (const Counter & c : counters)
+		{
+			if (c.fd < 0)
+				printf("  %-18s unavailable\n", c.name);
+			else
+				printf("  %-18s %14llu  (%.3f)\n", c.name,
+						(unsigned long long) c.value, c.value / units);
+		}
+	}
+
+	~PerfCounters()
+	{
+		for (Counter & c : counters)
+		{
+			if (c.fd >= 0) close(c.fd);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+
+#include "pages.h"
+
+/*
+ * small work-stealing thread pool. Every worker owns a deque: it pops its
+ * own work from the back (newest first, still warm in cache) and, when that
+ * runs dry, steals from the front of a randomly chosen victim.
+ *
+ * Tasks get the id of the worker running them. Tasks submitted from inside
+ * a task go to that worker's own deque, everything else is dealt round
+ * robin.
+ */
+class WorkPool
+{
+	public:
+
+	typedef std::function<void(int)> Task;
+
+	private:
+
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<Task> tasks;
+		std::thread thread;
+
+		// only touched by the worker itself, read once the pool is drained
+		long busy_ns = 0;
+		long tasks_run = 0;
+		long steals = 0;
+	};
+
+	std::vector<Worker *> workers;
+
+	// tasks sitting in some deque / submitted but not finished yet
+	std::atomic<long> queued;
+	std::atomic<long> pending;
+	std::atomic<bool> stopping;
+	std::atomic<unsigned> next_victim;
+
+	std::mutex idle_lock;
+	std::condition_variable wake;
+	std::condition_variable drained;
+
+	std::chrono::steady_clock::time_point window_start;
+
+	// which worker (of which pool) the calling thread is
+	static inline thread_local WorkPool * current_pool = nullptr;
+	static inline thread_local int current_worker = -1;
+
+	public:
+
+	WorkPool(int count) : queued(0), pending(0), stopping(false), next_victim(0)
+	{
+		for (int i = 0; i < count; i++)
+			workers.push_back(new Worker());
+
+		window_start = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < count; i++)
+			workers[i]->thread = std::thread(&WorkPool::run, this, i);
+	}
+
+	WorkPool(const WorkPool &) = delete;
+	WorkPool & operator=(const WorkPool &) = delete;
+
+	int size() const { return workers.size(); }
+
+	/* pin worker i to the i-th allowed cpu, false if any of them failed */
+	bool pin()
+	{
+		bool pinned = true;
+		for (size_t i = 0; i < workers.size(); i++)
+			pinned = pin_thread(i, workers[i]->thread.native_handle()) && pinned;
+
+		return pinned;
+	}
+
+	void submit(Task task)
+	{
+		int target = current_pool == this ? current_worker
+			: next_victim.fetch_add(1, std::memory_order_relaxed) % workers.size();
+
+		pending++;
+		{
+			std::lock_guard<std::mutex> guard(workers[target]->lock);
+			workers[target]->tasks.push_back(std::move(task));
+		}
+		queued++;
+
+		// a worker checks [queued] under this lock before it sleeps
+		{ std::lock_guard<std::mutex> guard(idle_lock); }
+		wake.notify_one();
+	}
+
+	/* block until every submitted task is done (not from inside a task) */
+	void wait()
+	{
+		std::unique_lock<std::mutex> guard(idle_lock);
+		drained.wait(guard, [&] { return pending == 0; });
+	}
+
+	/* start a new busy / idle measuring window (while drained) */
+	void reset_stats()
+	{
+		for (Worker * w : workers)
+		{
+			w->busy_ns = 0;
+			w->tasks_run = 0;
+			w->steals = 0;
+		}
+
+		window_start = std::chrono::steady_clock::now();
+	}
+
+	/* per worker busy / idle time since the last reset (while drained) */
+	void report() const
+	{
+		using namespace std::chrono;
+
+		double window = duration_cast<nanoseconds>(
+				steady_clock::now() - window_start).count() / 1e6;
+
+		printf("Worker   busy(ms)   idle(ms)    tasks   steals\n");
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			Worker * w = workers[i];
+			double busy = w->busy_ns / 1e6;
+			printf("%6zu %10.1f %10.1f %8ld %8ld\n", i, busy,
+					window > busy ? window - busy : 0.0, w->tasks_run, w->steals);
+		}
+	}
+
+	~WorkPool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(idle_lock);
+			stopping = true;
+		}
+		wake.notify_all();
+
+		// others may still be looking at a worker's deque until they all quit
+		for (Worker * w : workers)
+			w->thread.join();
+
+		for (Worker * w : workers)
+			delete w;
+	}
+
+	private:
+
+	bool pop(int id, Task & task)
+	{
+		Worker * w = workers[id];
+		std::lock_guard<std::mutex> guard(w->lock);
+		if (w->tasks.empty()) return false;
+
+		task = std::move(w->tasks.back());
+		w->tasks.pop_back();
+		return true;
+	}
+
+	bool steal(int id, std::minstd_rand & rng, Task & task)
+	{
+		int count = workers.size();
+		int first = rng() % count;
+
+		for (int i = 0; i < count; i++)
+		{
+			int victim = (first + i) % count;
+			if (victim == id) continue;
+
+			Worker * w = workers[victim];
+			std::lock_guard<std::mutex> guard(w->lock);
+			if (w->tasks.empty()) continue;
+
+			task = std::move(w->tasks.front());
+			w->tasks.pop_front();
+			workers[id]->steals++;
+			return true;
+		}
+
+		return false;
+	}
+
+	void run(int id)
+	{
+		using namespace std::chrono;
+
+		current_pool = this;
+		current_worker = id;
+
+		std::minstd_rand rng(id + 1);
+		Worker * self = workers[id];
+
+		for (;;)
+		{
+			Task task;
+			if (pop(id, task) || steal(id, rng, task))
+			{
+				queued--;
+
+				auto start = steady_clock::now();
+				task(id);
+				self->busy_ns += duration_cast<nanoseconds>(
+						steady_clock::now() - start).count();
+				self->tasks_run++;
+
+				if (--pending == 0)
+				{
+					{ std::lock_guard<std::mutex> guard(idle_lock); }
+					drained.notify_all();
+				}
+				continue;
+			}
+
+			// nothing anywhere, sleep until something is submitted
+			std::unique_lock<std::mutex> guard(idle_lock);
+			wake.wait(guard, [&] { return queued > 0 || stopping; });
+			if (stopping && queued == 0) break;
+		}
+	}
+};
+
+#endif
@@ -1,132 +1,245 @@
 #include <atomic>
 #include <chrono>
-#include <list>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include <functional>
-#include <future>
 #include <vector>
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+
+#include "bitmap.h"
+#include "pool.h"
 
 int THREAD_COUNT = 8;
 const unsigned long int PRIME_RANGE = 100000000;  // 10^8
 const unsigned long int SQRT_PRIME_RANGE = 10000; // 10^4
 
 // for convenience
-using std::shared_ptr;
-using std::shared_future;
-using std::promise;
 using std::atomic;
 
-struct iteration_t
+/*
+ * reusable, allocation free sense-reversing barrier. Waiters spin for a
+ * while (the other threads are usually close behind), then park on a
+ * condition variable so an oversubscribed box doesn't burn its cores.
+ */
+struct SpinBarrier
 {
-	long int prime;
-	bool halt;
+	// spins before parking
+	const int SPIN_LIMIT = 4096;
+
+	const int count;
 
-	shared_ptr<atomic<int>> done_count;
-	shared_ptr<promise<iteration_t>> next;
+	atomic<int> arrived;
+	atomic<bool> sense;
 
-	shared_future<iteration_t> next_fut;
+	// threads currently parked, the releaser only notifies if there are any
+	atomic<int> sleepers;
+	std::mutex lock;
+	std::condition_variable parked;
 
-	iteration_t() : 
-		done_count(new atomic<int>(0)), next(new promise<iteration_t>()),
-		next_fut((*next).get_future())
+	SpinBarrier(int _count) : count(_count), arrived(0), sense(false), sleepers(0)
 	{
 	}
+
+	/*
+	 * the last thread to arrive runs [completion] before anyone is released.
+	 * [local_sense] is per thread state, starting at false
+	 */
+	template <class F>
+	void arrive_and_wait(bool & local_sense, F completion)
+	{
+		local_sense = !local_sense;
+
+		if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == count)
+		{
+			completion();
+
+			arrived.store(0, std::memory_order_relaxed);
+			sense.store(local_sense);
+
+			if (sleepers > 0)
+			{
+				// taking the lock orders us after any waiter's predicate check
+				{ std::lock_guard<std::mutex> guard(lock); }
+				parked.notify_all();
+			}
+			return;
+		}
+
+		for (int i = 0; i < SPIN_LIMIT; i++)
+		{
+			if (sense.load(std::memory_order_acquire) == local_sense) return;
+			__builtin_ia32_pause();
+		}
+
+		std::unique_lock<std::mutex> guard(lock);
+		sleepers++;
+		parked.wait(guard, [&] { return sense.load() == local_sense; });
+		sleepers--;
+	}
 };
 
-void print_rest(bool * is_composite, int start)
+// the prime every thread is currently crossing off, published by whoever
+// completes the barrier
+atomic<long> current_prime(2);
+
+// time each thread spent inside the barrier
+std::vector<long> barrier_wait_ns;
+
+void print_rest(OddBitmap * is_composite, prime_t start)
 {
 	if (start % 2 == 0) start++;
-	for (int i = start; i < PRIME_RANGE; i += 2)
+	for (prime_t i = start; i < PRIME_RANGE; i += 2)
 	{
-		if (is_composite[i]) printf("Found new prime: %d\n", i);
+		if (!is_composite->get(i)) printf("Found new prime: %lu\n", i);
 	}
 }
 
-void sieve(int id, bool * is_composite, iteration_t iteration)
+/* 
+ * compute composites indexed by [id] (mod THREAD_COUNT) classes. Only odd
+ * multiples are stored, starting from prime^2. Words are shared between the
+ * classes, so the writes have to be atomic
+ */
+void cross_off(int id, long prime, OddBitmap * is_composite)
 {
-	while (!iteration.halt)
+	long step = 2 * THREAD_COUNT * prime;
+	for (long i = prime * prime + 2 * id * prime; prime != 2 && i < PRIME_RANGE; i += step)
 	{
+		is_composite->set_atomic(i);
+		for (int j = 0; j < 100; j++);
+	}
+}
 
-		// --- Compute composites indexed by [id] (mod 8) classes --------------
-		
-		long prime = iteration.prime;
-		for (long i = prime + id * prime; i < PRIME_RANGE; i += THREAD_COUNT * prime)
-		{
-			is_composite[i] = true;
-			for (int j = 0; j < 100; j++);
-		}
+long next_prime(long prime, OddBitmap * is_composite)
+{
+	long next = prime == 2 ? 1 : prime;
+	do
+	{
+		next += 2;
+	} while (is_composite->get_atomic(next));
 
-		// --- Synchronize with other threads ----------------------------------
+	return next;
+}
 
-		int done = (*iteration.done_count).fetch_add(1, std::memory_order_relaxed) + 1;
+void sieve(int id, OddBitmap * is_composite, SpinBarrier * barrier)
+{
+	using namespace std::chrono;
 
-		if (done == THREAD_COUNT)
-		{
-			// only one thread should reach this state at a time 
-			iteration_t new_iter;
+	bool sense = false;
+	long wait_ns = 0;
 
-			// find next prime
-			long prime = iteration.prime == 2 ? 1 : iteration.prime;
-			do
-			{ 
-				prime += 2;
-			} while (is_composite[prime]);
+	// the barrier orders this with the store that published it
+	long prime;
+	while ((prime = current_prime.load(std::memory_order_relaxed)) <= SQRT_PRIME_RANGE)
+	{
 
-			//printf("Found new prime: %d\n", prime);
+		// --- Compute composites indexed by [id] (mod 8) classes --------------
 
-			new_iter.prime = prime;
+		cross_off(id, prime, is_composite);
 
-			new_iter.halt = prime > SQRT_PRIME_RANGE;
+		// --- Synchronize with other threads ----------------------------------
 
-			//if (new_iter.halt) print_rest(is_composite, prime);
+		auto wait_start = steady_clock::now();
 
-			// provide new iteration to all threads
-			iteration.next->set_value(new_iter);
-			iteration = new_iter;
-		} else
+		barrier->arrive_and_wait(sense, [&]
 		{
-			// wait for next iteration
-			iteration = iteration.next_fut.get();
-		}
+			// only one thread should reach this state at a time, find the
+			// next prime
+			long next = next_prime(prime, is_composite);
+
+			//printf("Found new prime: %d\n", next);
+
+			current_prime.store(next, std::memory_order_relaxed);
+		});
+
+		wait_ns += duration_cast<nanoseconds>(steady_clock::now() - wait_start).count();
 	}
 
+	barrier_wait_ns[id] = wait_ns;
+
 	//printf("Thread %d exiting...\n", id);
 }
 
+/* 
+ * same lock-step pipeline, but every residue class is a task on the
+ * work-stealing pool and draining the pool is the barrier
+ */
+void sieve_pooled(OddBitmap * is_composite, WorkPool & pool)
+{
+	for (long prime = 2; prime <= (long) SQRT_PRIME_RANGE;
+			prime = next_prime(prime, is_composite))
+	{
+		for (int id = 0; id < THREAD_COUNT; id++)
+			pool.submit([=](int) { cross_off(id, prime, is_composite); });
+
+		pool.wait();
+	}
+}
+
 int main(int argc, char ** argv)
 {
+	using namespace std::chrono;
+
 	if (argc > 1)
 		THREAD_COUNT = atoi(argv[1]);
 
-	bool * buffer = new bool[PRIME_RANGE];
-
-	std::fill(buffer, buffer + PRIME_RANGE, false);
+	bool pooled = argc > 2 && strcmp(argv[2], "pool") == 0;
 
-	iteration_t first;
-	// load in the first prime
-	first.prime = 2; 
-	first.halt = false;
+	OddBitmap * buffer = new OddBitmap(PRIME_RANGE);
+	WorkPool * pool = pooled ? new WorkPool(THREAD_COUNT) : nullptr;
 
+	SpinBarrier barrier(THREAD_COUNT);
+	barrier_wait_ns.assign(THREAD_COUNT, 0);
 
 	std::vector<std::thread> threads;
 
 	printf("Spawning threads...\n");
 
-	for (int i = 0; i < THREAD_COUNT; i++)
+	auto start_time = steady_clock::now();
+
+	if (pooled)
 	{
-		threads.push_back(std::thread(sieve, i, buffer, first));
+		sieve_pooled(buffer, *pool);
+	} else
+	{
+		for (int i = 0; i < THREAD_COUNT; i++)
+		{
+			threads.push_back(std::thread(sieve, i, buffer, &barrier));
+		}
+
+		for (auto & t : threads) t.join();
 	}
 
-	for (auto & t : threads) t.join();
+	auto stop_time = steady_clock::now();
 
-	printf("Program done");
+	// --- Report synchronization overhead -------------------------------------
 
-	delete [] buffer;
+	// every prime up to SQRT_PRIME_RANGE (2 included) is one barrier crossing
+	long crossings = 0;
+	for (long p = 2; p <= (long) SQRT_PRIME_RANGE; p++)
+		crossings += !buffer->get(p);
 
-	return 0;
-}
+	long wait_ns = 0;
+	for (long ns : barrier_wait_ns) wait_ns += ns;
 
+	printf("Program done, %lu primes found\n", buffer->count());
+	printf("Execution time: %ldms\n",
+			(long) duration_cast<milliseconds>(stop_time - start_time).count());
 
+	if (pooled)
+	{
+		pool->report();
+		delete pool;
+	} else
+	{
+		printf("Barrier: %ld crossings, %.3fus average wait per prime per thread\n",
+				crossings, wait_ns / 1000.0 / crossings / THREAD_COUNT);
+	}
+
+	delete buffer;
+
+	return 0;
+}
@@ -1,23 +1,98 @@
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <future>
+#include <memory>
 #include <vector>
-#include <list>
 #include <functional>
+#include <random>
 
 #include <cmath>
 #include <cstdio> // I'm sorry, I really like printf()
+#include <cstdlib>
+#include <cstring>
 
-typedef unsigned long prime_t;
+#include <unistd.h> // getopt()
+
+#include "millerrabin.h"
+#include "pool.h"
+#include "trial.h"
+#include "wheel.h"
 
 int THREAD_COUNT = 8;
+
+// jobs the range is cut into per thread, so the pool has something to balance
+int JOBS_PER_THREAD = 32;
 //const prime_t PRIME_RANGE = 100000000;  // 10^8
 const prime_t PRIME_RANGE = 10000000;  // 10^8
 const prime_t SQRT_PRIME_RANGE = 10000; // 10^4
 
+// how candidates are tested
+enum Backend { HIVE, TRIAL, BATCH, MILLER_RABIN, BACKEND_COUNT };
+const char * BACKEND_NAMES[] = { "hive", "trial", "batch", "mr" };
+
+/*
+ * append-only vector for one writer and any number of concurrent readers.
+ * Elements live in fixed size chunks that never move, so a reader can scan
+ * the first size() elements as plain arrays while the writer keeps
+ * appending. The chunk table is sized up front from the capacity.
+ */
+template <class T>
+class ChunkedVector
+{
+	public:
+
+	static constexpr size_t CHUNK_SIZE = 1024;
+
+	private:
+
+	std::vector<T *> chunks;
+	std::atomic<size_t> count;
+
+	public:
+
+	ChunkedVector(size_t capacity) :
+		chunks((capacity + CHUNK_SIZE - 1) / CHUNK_SIZE, nullptr), count(0)
+	{
+	}
+
+	ChunkedVector(const ChunkedVector &) = delete;
+	ChunkedVector & operator=(const ChunkedVector &) = delete;
+
+	/* writer only */
+	void push_back(T val)
+	{
+		size_t n = count.load(std::memory_order_relaxed);
+		if (n % CHUNK_SIZE == 0)
+			chunks[n / CHUNK_SIZE] = new T[CHUNK_SIZE];
+
+		chunks[n / CHUNK_SIZE][n % CHUNK_SIZE] = val;
+
+		// publishes the element (and its chunk) to readers
+		count.store(n + 1, std::memory_order_release);
+	}
+
+	size_t size() const
+	{
+		return count.load(std::memory_order_acquire);
+	}
+
+	/* chunk [i], valid for the elements below a size() already read */
+	const T * chunk(size_t i) const
+	{
+		return chunks[i];
+	}
+
+	~ChunkedVector()
+	{
+		for (T * c : chunks) delete [] c;
+	}
+};
+
 struct Job
 {
-	// apparently thread-safe
-	std::list<prime_t> prime_block;
+	// primes found so far, in ascending order
+	std::shared_ptr<ChunkedVector<prime_t>> prime_block;
 	// shared ptr was necessary because atomics are 
 	// non-copy-constructible
 	std::shared_ptr<std::atomic<prime_t>> cur;
@@ -27,47 +102,68 @@ struct Job
 
 	int id;
 
-	Job() : cur(new std::atomic<prime_t>(0)) { }
+	// at most every other number in the range can be prime (plus the wheel)
+	Job(int _id, prime_t _start, prime_t _end) : 
+		prime_block(new ChunkedVector<prime_t>((_end - _start) / 2 + 8)),
+		cur(new std::atomic<prime_t>(_start)), start(_start), end(_end), id(_id)
+	{
+	}
 
 };
 
 struct Hive
 {
 	std::vector<Job> jobs;
+
+	// candidates are only taken from the spokes of this wheel
+	Wheel * wheel;
+
+	int backend = HIVE;
+
+	// divisors up to SQRT_PRIME_RANGE for the BATCH backend
+	BatchTrial * batch = nullptr;
 };
 
+/* 
+ * trial divide by the primes the hive has found so far. Jobs are walked in
+ * ascending order; whatever part of a job's range hasn't been searched yet
+ * is filled in by brute force, so this never waits on another job.
+ */
 bool is_prime_hive(prime_t test, Hive & hive)
 {
-	if (test % 2 == 0) return false;
+	if (test % 2 == 0) return test == 2;
 
 	prime_t test_end = sqrt(test);
 
-	auto job_it = hive.jobs.begin();
-	for (prime_t p = 3; p <= test_end;)
+	for (Job & job : hive.jobs)
 	{
-		Job & job = *job_it;
-		std::list<prime_t> & block = job.prime_block;
+		if (job.start > test_end) break;
 
-		// use block
+		// [cur] is stored after the primes below it are pushed, so the
+		// block holds at least all of those
 		prime_t block_cur = *job.cur;
-		for (prime_t p : block)
+		const ChunkedVector<prime_t> & block = *job.prime_block;
+		size_t count = block.size();
+
+		// use block, one contiguous chunk at a time
+		for (size_t c = 0; c * block.CHUNK_SIZE < count; c++)
 		{
-			if (p > block_cur || p >= test_end) break;
-			if (test % p == 0) return false;
+			const prime_t * primes = block.chunk(c);
+			size_t n = std::min(block.CHUNK_SIZE, count - c * block.CHUNK_SIZE);
+
+			for (size_t i = 0; i < n; i++)
+			{
+				if (primes[i] > test_end) return true;
+				if (test % primes[i] == 0) return false;
+			}
 		}
-		p = block_cur;
 
-		if (p >= test_end) break;
-
-		// fill in to next block (if there is one)
-		auto old_it = job_it;
-		prime_t stop = job_it != hive.jobs.end() ? (*job_it).start : test_end;
-		job_it = old_it;
-
-		if (p % 2 == 0) ++p;
-		for (; p < stop; p += 2)
+		// fill in the rest of the job's range
+		prime_t p = std::max(block_cur + 1, job.start) | 1;
+		prime_t stop = std::min(job.end - 1, test_end);
+		for (; p <= stop; p += 2)
 		{
-			if (test % p == 0) return false;
+			if (p > 1 && test % p == 0) return false;
 		}
 	}
 
@@ -79,7 +175,7 @@ bool is_prime(prime_t test)
 	if (test % 2 == 0) return false;
 
 	prime_t max = sqrt(test);
-	for (prime_t i = 3; i < max; i += 2)
+	for (prime_t i = 3; i <= max; i += 2)
 	{
 		if (test % i == 0) return false;
 	}
@@ -90,19 +186,56 @@ bool is_prime(prime_t test)
 void find_primes(Hive & hive, Job & job) 
 { 
 
-	auto & primes = job.prime_block;
+	auto & primes = *job.prime_block;
+	Wheel & wheel = *hive.wheel;
 
-	if (job.start <= 2)
+	// the wheel primes are never candidates themselves
+	for (prime_t p : wheel.get_primes())
 	{
-		primes.push_back(2);
-		job.start = 3;
+		if (p >= job.start && p < job.end) primes.push_back(p);
 	}
 
-	if (job.start % 2 == 0) job.start++;
-	for (prime_t t = job.start; t < job.end; t += 2)
+	size_t spoke;
+	prime_t first = std::max(job.start, wheel.get_primes().back() + 1);
+
+	// everything below the first candidate is now accounted for
+	if (first > job.start) *job.cur = first - 1;
+
+	// candidates waiting to be tested together (BATCH backend)
+	prime_t batch[BatchTrial::BATCH_SIZE];
+	bool batch_prime[BatchTrial::BATCH_SIZE];
+	int batched = 0;
+
+	auto flush = [&]()
 	{
-		//bool succ = is_prime(t);
-		bool succ = is_prime_hive(t, hive);
+		hive.batch->test(batch, batched, batch_prime);
+		for (int i = 0; i < batched; i++)
+		{
+			if (batch_prime[i]) primes.push_back(batch[i]);
+		}
+
+		*job.cur = batch[batched - 1];
+		batched = 0;
+	};
+
+	for (prime_t t = wheel.first_candidate(first, spoke); t < job.end;
+			t = wheel.next_candidate(t, spoke))
+	{
+		if (hive.backend == BATCH)
+		{
+			batch[batched++] = t;
+			if (batched == BatchTrial::BATCH_SIZE) flush();
+			continue;
+		}
+
+		bool succ;
+		switch (hive.backend)
+		{
+			case HIVE: succ = is_prime_hive(t, hive); break;
+			case MILLER_RABIN: succ = is_prime_mr(t); break;
+			default: succ = is_prime(t); break;
+		}
+
 		if (succ)
 		{
 			//printf("Thread %d found %d.\n", job.id, t);
@@ -112,44 +245,155 @@ void find_primes(Hive & hive, Job & job)
 		// TODO: can be weaker
 		*job.cur = t;
 	}
+
+	if (batched > 0) flush();
+}
+
+/* 
+ * test [count] random odd 64-bit numbers with Miller-Rabin, no sieving
+ */
+void screen_random(prime_t count)
+{
+	using namespace std::chrono;
+
+	std::vector<uint64_t> candidates(count);
+	std::unique_ptr<bool[]> results(new bool[count]);
+
+	std::mt19937_64 rng(count);
+	for (uint64_t & n : candidates)
+		n = rng() | 1;
+
+	WorkPool pool(THREAD_COUNT);
+
+	auto start_time = steady_clock::now();
+	is_prime_mr_batch(candidates.data(), count, results.get(), pool);
+	auto stop_time = steady_clock::now();
+
+	prime_t found = 0;
+	for (prime_t i = 0; i < count; i++)
+		found += results[i];
+
+	double seconds = duration_cast<nanoseconds>(stop_time - start_time).count() / 1e9;
+	printf("Screened %lu random odd 64-bit numbers, %lu primes\n", count, found);
+	printf("Execution time: %.0fms (%.2f million per second)\n",
+			seconds * 1000, count / seconds / 1e6);
+	pool.report();
 }
 
 int main(int argc, char ** argv)
 {
-	if (argc > 1)
-		THREAD_COUNT = atoi(argv[1]);
+	prime_t wheel_size = 210;
+	int backend = HIVE;
+	int kernel = -1;
+	prime_t screen = 0;
+
+	int opt;
+	bool valid = true;
+	while ((opt = getopt(argc, argv, "w:j:m:k:r:")) != -1)
+	{
+		if (opt == 'w') wheel_size = strtoul(optarg, nullptr, 10);
+		else if (opt == 'r') screen = strtoul(optarg, nullptr, 10);
+		else if (opt == 'j') JOBS_PER_THREAD = atoi(optarg);
+		else if (opt == 'm')
+		{
+			backend = -1;
+			for (int i = 0; i < BACKEND_COUNT; i++)
+			{
+				if (strcmp(optarg, BACKEND_NAMES[i]) == 0) backend = i;
+			}
+		}
+		else if (opt == 'k')
+		{
+			for (int i = 0; i < BatchTrial::KERNEL_COUNT; i++)
+			{
+				if (strcmp(optarg, BatchTrial::kernel_name((BatchTrial::Kernel) i)) == 0)
+					kernel = i;
+			}
+			valid = valid && kernel >= 0;
+		}
+		else valid = false;
+	}
 
-	std::vector<std::thread> threads;
+	if (optind < argc)
+		THREAD_COUNT = atoi(argv[optind]);
 
-	Hive hive;
-	for (int i = 0; i < THREAD_COUNT; i++)
-		hive.jobs.push_back(Job());
+	if (!valid || !Wheel::valid(wheel_size) || JOBS_PER_THREAD < 1 || backend < 0)
+	{
+		printf("usage: %s [-w 2|6|30|210|2310] [-j jobs_per_thread] "
+				"[-m hive|trial|batch|mr] [-k scalar|avx2|avx512] [-r random_count] "
+				"[thread_count]\n", argv[0]);
+		return 1;
+	}
 
-	printf("Spawning threads...\n");
+	if (screen > 0)
+	{
+		screen_random(screen);
+		return 0;
+	}
+
+	int job_count = THREAD_COUNT * JOBS_PER_THREAD;
 
-	prime_t block_size = PRIME_RANGE / THREAD_COUNT;
-	for (int i = 0; i < THREAD_COUNT; i++)
+	Hive hive;
+	hive.wheel = new Wheel(wheel_size);
+	hive.backend = backend;
+
+	if (backend == BATCH)
 	{
-		hive.jobs[i].id = i;
-		hive.jobs[i].start = i * block_size;
-		hive.jobs[i].end = (i + 1) * block_size;
+		std::vector<prime_t> divisors;
+		for (prime_t p = 3; p * p < PRIME_RANGE + 2 * p; p += 2)
+		{
+			if (is_prime(p)) divisors.push_back(p);
+		}
 
-		*hive.jobs[i].cur = hive.jobs[i].start;
+		hive.batch = new BatchTrial(divisors);
+		if (kernel >= 0 && !hive.batch->set_kernel((BatchTrial::Kernel) kernel))
+		{
+			printf("This cpu can't run the %s kernel\n",
+					BatchTrial::kernel_name((BatchTrial::Kernel) kernel));
+			return 1;
+		}
+	}
 
-		threads.push_back( std::thread(find_primes, 
-					std::ref(hive), std::ref(hive.jobs[i]) ));
+	prime_t block_size = PRIME_RANGE / job_count;
+	for (int i = 0; i < job_count; i++)
+	{
+		prime_t end = i + 1 < job_count ? (i + 1) * block_size : PRIME_RANGE;
+		hive.jobs.push_back(Job(i, i * block_size, end));
 	}
 
-	for (auto & t : threads) 
-		t.join();
+	printf("Spawning threads...\n");
 
-	printf("Program done\n");
-	for (Job & j : hive.jobs)
+	WorkPool pool(THREAD_COUNT);
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	// submitted highest first: workers pop their newest task, so the low jobs
+	// (which everyone else trial divides by) tend to be picked up first
+	for (int i = job_count - 1; i >= 0; i--)
 	{
-		printf("(%8d - %8d) contains %d primes\n", 
-				j.start, j.end, j.prime_block.size());
+		Job & job = hive.jobs[i];
+		pool.submit([&](int) { find_primes(hive, job); });
 	}
 
+	pool.wait();
+
+	auto stop_time = std::chrono::steady_clock::now();
+
+	prime_t total = 0;
+	for (Job & j : hive.jobs)
+		total += j.prime_block->size();
+
+	printf("Program done, %lu primes below %lu\n", total, PRIME_RANGE);
+	printf("Execution time: %ldms (%s", (long) std::chrono::duration_cast<
+			std::chrono::milliseconds>(stop_time - start_time).count(),
+			BACKEND_NAMES[backend]);
+	if (hive.batch) printf(", %s", BatchTrial::kernel_name(hive.batch->get_kernel()));
+	printf(")\n");
+	pool.report();
+
+	delete hive.wheel;
+	delete hive.batch;
+
 	return 0;
 }
 
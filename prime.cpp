@@ -1,8 +1,10 @@
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <chrono>
 #include <list>
+#include <queue>
 #include <thread>
 #include <functional>
 #include <future>
@@ -10,18 +12,61 @@
 
 #include <cstdio>
 #include <cstdlib>
-
-typedef unsigned long int prime_t;
+#include <cstring>
+
+#include <unistd.h> // getopt()
+
+#include "bitmap.h"
+#include "incremental.h"
+#include "kernels.h"
+#include "perf.h"
+#include "pool.h"
+#include "primecount.h"
+#include "primestream.h"
+#include "primetable.h"
+#include "rankindex.h"
+#include "tune.h"
+#include "wheel.h"
 
 int THREAD_COUNT = 8;
 
 const prime_t PRIME_RANGE = 100000000;  // 10^8
 const prime_t SQRT_PRIME_RANGE = 10000; // 10^4
 
+// where -A keeps its measurements
+const char * TUNING_FILE = "prime.tune";
+
+// integers per segment, sized so its slice of the bitmap sits in L1/L2 while
+// it is being sieved (rounded to whole ownership units)
+prime_t SEGMENT_SIZE = 256 * 1024;
+
+// integers per cache line / page of the bitmap
+const prime_t LINE_SPAN = 64 * 16;
+const prime_t PAGE_SPAN = 4096 * 16;
+
+// boundary segments and partitions are aligned to, so no two threads ever
+// write to the same cache line (or page)
+prime_t OWNERSHIP_SPAN = LINE_SPAN;
+
+enum Mode { STRIDE, SEGMENTED, PARTITIONED, POOLED, MODE_COUNT };
+const char * MODE_NAMES[] = { "stride", "segmented", "partitioned", "pool" };
+
 std::atomic<prime_t> last_prime_found(0);
+std::atomic<prime_t> next_segment(0);
+
+// primes up to SQRT_PRIME_RANGE, shared read-only by the segmented sieve
+std::vector<prime_t> base_primes;
+
+// presieve for the smallest primes (2 disables it)
+Wheel * wheel = nullptr;
 
-void sieve(int id, bool * is_composite)
+// pin thread i to the i-th cpu
+bool PIN_THREADS = false;
+
+void sieve(int id, OddBitmap * is_composite)
 {
+	if (PIN_THREADS) pin_thread(id);
+
 	bool running = true;
 	while (running)
 	{
@@ -40,7 +85,7 @@ void sieve(int id, bool * is_composite)
 				break;
 			}
 
-			if (!is_composite[prime])
+			if (!is_composite->get_atomic(prime))
 			{ 
 				// we found one, attempt to claim it. Otherwise catchup
 				prime_t last = last_prime_found;
@@ -59,79 +104,660 @@ void sieve(int id, bool * is_composite)
 		// But if this were the case, no harm is done, just extra work.
 
 		// --- Remove all multiples of this prime ------------------------------
-		
-		for (prime_t i = 2 * prime; i < PRIME_RANGE; i += prime)
+
+		// even multiples aren't stored. Other threads are writing to the
+		// same words, so every write has to be an atomic or
+		if (prime == 2) continue;
+
+		for (prime_t i = prime * prime; i < PRIME_RANGE; i += 2 * prime)
 		{
+			is_composite->set_atomic(i);
+		}
+	}
+}
+
+/* 
+ * serially sieve the (small) base primes, every segment needs all of them
+ */
+void find_base_primes()
+{
+	std::vector<bool> is_composite(SQRT_PRIME_RANGE + 1, false);
+
+	base_primes.clear();
+	for (prime_t p = 2; p <= SQRT_PRIME_RANGE; p++)
+	{
+		if (is_composite[p]) continue;
+
+		base_primes.push_back(p);
+		for (prime_t i = p * p; i <= SQRT_PRIME_RANGE; i += p)
 			is_composite[i] = true;
+	}
+}
+
+/* 
+ * cross off every base prime inside [lo, hi), touching nothing outside it.
+ * With FIXED_KERNELS the primes below kernels::LIMIT go through their
+ * compile time generated kernels instead of the generic strided loop
+ */
+template <bool FIXED_KERNELS>
+void sieve_segment(prime_t lo, prime_t hi, OddBitmap * is_composite)
+{
+	// stamp in the small primes first, then skip them
+	prime_t first = lo / OddBitmap::WORD_SPAN;
+	prime_t last = std::min((hi + OddBitmap::WORD_SPAN - 1) / OddBitmap::WORD_SPAN,
+			is_composite->size());
+	wheel->stamp(*is_composite, first, last - first);
+
+	for (prime_t prime : base_primes)
+	{
+		if (wheel->covers(prime)) continue;
+		if (prime * prime >= hi) break;
+
+		kernels::Kernel kernel = kernels::TABLE[prime];
+		if (FIXED_KERNELS && kernel)
+		{
+			// segments are whole words, apart from the padding at the end
+			kernel(is_composite->data(), first, last - first);
+			if (first == 0) is_composite->data()[0] &= ~OddBitmap::bit(prime);
+			continue;
 		}
+
+		// first odd multiple inside the segment (but never the prime itself)
+		prime_t i = (lo + prime - 1) / prime * prime;
+		if (i < prime * prime) i = prime * prime;
+		if (i % 2 == 0) i += prime;
+
+		for (; i < hi; i += 2 * prime)
+			is_composite->set(i);
 	}
 }
 
-int main(int argc, char ** argv)
+// the variant every segment goes through (-k)
+void (*segment_sieve)(prime_t, prime_t, OddBitmap *) = sieve_segment<true>;
+
+void sieve_segmented(int id, OddBitmap * is_composite)
+{
+	if (PIN_THREADS) pin_thread(id);
+
+	for (;;)
+	{
+		// --- Claim the next whole segment ------------------------------------
+		prime_t lo = next_segment.fetch_add(SEGMENT_SIZE);
+		if (lo >= PRIME_RANGE) break;
+
+		prime_t hi = std::min(lo + SEGMENT_SIZE, PRIME_RANGE);
+
+		segment_sieve(lo, hi, is_composite);
+	}
+}
+
+/* 
+ * each thread owns one contiguous, OWNERSHIP_SPAN aligned stretch of the
+ * bitmap and runs the per-prime passes over it alone. Nothing is shared, so
+ * plain writes are safe and no line ping-pongs between cores
+ */
+void sieve_partitioned(int id, OddBitmap * is_composite)
+{
+	if (PIN_THREADS) pin_thread(id);
+
+	prime_t chunk = (PRIME_RANGE + THREAD_COUNT - 1) / THREAD_COUNT;
+	chunk = (chunk + OWNERSHIP_SPAN - 1) / OWNERSHIP_SPAN * OWNERSHIP_SPAN;
+
+	prime_t lo = id * chunk;
+	prime_t hi = std::min(lo + chunk, PRIME_RANGE);
+
+	if (lo < hi) segment_sieve(lo, hi, is_composite);
+}
+
+/* 
+ * stamp the wheel over one contiguous stretch of the bitmap per thread, so
+ * the pages of an untouched bitmap are spread over the threads' nodes
+ */
+void presieve_partitioned(int id, OddBitmap * is_composite)
+{
+	if (PIN_THREADS) pin_thread(id);
+
+	prime_t chunk = (is_composite->size() + THREAD_COUNT - 1) / THREAD_COUNT;
+	prime_t first = std::min(id * chunk, is_composite->size());
+	prime_t last = std::min(first + chunk, is_composite->size());
+
+	wheel->stamp(*is_composite, first, last - first);
+}
+
+/* 
+ * hand every segment to the work-stealing pool as its own task
+ */
+void sieve_pooled(WorkPool & pool, OddBitmap * is_composite)
+{
+	for (prime_t lo = 0; lo < PRIME_RANGE; lo += SEGMENT_SIZE)
+	{
+		prime_t hi = std::min(lo + SEGMENT_SIZE, PRIME_RANGE);
+		pool.submit([=](int) { segment_sieve(lo, hi, is_composite); });
+	}
+
+	pool.wait();
+}
+
+/* 
+ * one full sieve of [0, PRIME_RANGE) in [mode]. [untouched] is a bitmap
+ * whose pages nobody has written yet
+ */
+void run_sieve(int mode, OddBitmap * buffer, WorkPool * pool, bool untouched)
+{
+	std::vector<std::thread> threads;
+	next_segment = 0;
+
+	if (mode == SEGMENTED)
+	{
+		find_base_primes();
+		for (int i = 0; i < THREAD_COUNT; i++)
+			threads.push_back(std::thread(sieve_segmented, i, buffer));
+	} else if (mode == POOLED)
+	{
+		find_base_primes();
+		pool->reset_stats();
+		sieve_pooled(*pool, buffer);
+	} else if (mode == PARTITIONED)
+	{
+		find_base_primes();
+		for (int i = 0; i < THREAD_COUNT; i++)
+			threads.push_back(std::thread(sieve_partitioned, i, buffer));
+	} else
+	{
+		// presieve everything up front, threads start claiming past the wheel
+		if (!untouched)
+		{
+			wheel->stamp(*buffer, 0, buffer->size());
+		} else
+		{
+			for (int i = 0; i < THREAD_COUNT; i++)
+				threads.push_back(std::thread(presieve_partitioned, i, buffer));
+
+			for (auto & t : threads) t.join();
+			threads.clear();
+		}
+		last_prime_found = wheel->get_primes().back();
+
+		for (int i = 0; i < THREAD_COUNT; i++)
+			threads.push_back(std::thread(sieve, i, buffer));
+	}
+
+	for (auto & t : threads) t.join();
+}
+
+/* 
+ * time of one -A calibration run of [mode]
+ */
+double calibration_run(int mode, OddBitmap * buffer, int threads, prime_t segment)
+{
+	using namespace std::chrono;
+
+	THREAD_COUNT = threads;
+	SEGMENT_SIZE = (segment + OWNERSHIP_SPAN - 1) / OWNERSHIP_SPAN * OWNERSHIP_SPAN;
+
+	WorkPool * pool = mode == POOLED ? new WorkPool(THREAD_COUNT) : nullptr;
+
+	auto start_time = steady_clock::now();
+	run_sieve(mode, buffer, pool, false);
+	auto stop_time = steady_clock::now();
+
+	delete pool;
+
+	return duration_cast<nanoseconds>(stop_time - start_time).count() / 1e6;
+}
+
+/* 
+ * set THREAD_COUNT and SEGMENT_SIZE from the tuning file, calibrating (and
+ * storing the result) if it has nothing for this host and mode
+ */
+void autotune(int mode)
+{
+	Autotuner tuner;
+	tuner.report();
+
+	Tuning tuning;
+	if (tuner.load(TUNING_FILE, MODE_NAMES[mode], tuning))
+	{
+		printf("Tuning: loaded from %s\n", TUNING_FILE);
+	} else
+	{
+		printf("Tuning: calibrating %s mode...\n", MODE_NAMES[mode]);
+
+		// stride mode has no segments, the others want a few per thread
+		prime_t max_segment = mode == STRIDE ? 0 : PRIME_RANGE / (4 * tuner.get_cpus());
+
+		OddBitmap buffer(PRIME_RANGE);
+		tuning = tuner.calibrate([&](int threads, prime_t segment)
+		{
+			return calibration_run(mode, &buffer, threads, segment ? segment : SEGMENT_SIZE);
+		}, max_segment);
+
+		if (!tuner.save(TUNING_FILE, MODE_NAMES[mode], tuning))
+			fprintf(stderr, "%s: could not store the tuning\n", TUNING_FILE);
+	}
+
+	printf("Tuning: %d threads, segment %lu\n", tuning.threads, tuning.segment_size);
+
+	THREAD_COUNT = tuning.threads;
+	if (tuning.segment_size > 0) SEGMENT_SIZE = tuning.segment_size;
+}
+
+/* 
+ * stream the primes of [lo, hi) instead of sieving [0, PRIME_RANGE)
+ */
+void stream_window(prime_t lo, prime_t hi)
 {
 	using namespace std::chrono;
 
-	if (argc > 1)
-		THREAD_COUNT = atoi(argv[1]);
+	auto start_time = steady_clock::now();
+
+	prime_t total = 0;
+	prime_t top_primes[10] = { 0 };
+
+	PrimeStream stream(lo, hi, SEGMENT_SIZE);
+	stream.for_each([&](prime_t p)
+	{
+		top_primes[total++ % 10] = p;
+	});
+
+	auto stop_time = steady_clock::now();
+
+	printf("Window: [%lu, %lu)\n", lo, hi);
+	printf("Execution time: %ldms\n",
+			(long) duration_cast<milliseconds>(stop_time - start_time).count());
+	printf("Prime count: %lu\n", total);
+	printf("Top 10 primes (least to greatest): \n");
+	for (prime_t i = 0; i < 10 && i < total; i++)
+		printf("[%lu] : %lu\n", i + 1, top_primes[(total + i - std::min<prime_t>(total, 10)) % 10]);
+}
+
+// how many of the largest primes to report
+const int TOP_COUNT = 10;
+
+struct Statistics
+{
+	prime_t count = 0;
+	prime_t sum = 0;
+
+	// the chunk's largest primes, greatest first
+	std::vector<prime_t> top;
+};
 
-	bool * buffer = new bool[PRIME_RANGE];
+/* 
+ * count, sum and largest primes of the words [first, last) of the bitmap
+ */
+void gather_chunk(const OddBitmap * is_composite, prime_t first, prime_t last,
+		Statistics * stats)
+{
+	const uint64_t * words = is_composite->data();
+	for (prime_t w = first; w < last; w++)
+	{
+		// walk the clear bits (primes) of each word
+		uint64_t primes = ~words[w];
+		stats->count += __builtin_popcountll(primes);
+		for (; primes != 0; primes &= primes - 1)
+			stats->sum += w * OddBitmap::WORD_SPAN + 2 * __builtin_ctzll(primes) + 1;
+	}
 
-	std::fill(buffer, buffer + PRIME_RANGE, false);
+	prime_t lo = first * OddBitmap::WORD_SPAN;
+	prime_t p = last * OddBitmap::WORD_SPAN;
+	while ((int) stats->top.size() < TOP_COUNT && (p = is_composite->prev_prime(p)) >= lo
+			&& p > 2)
+		stats->top.push_back(p);
+}
 
-	// threads start at the first prime, which skips 0 and 1, so hardcode
-	// them as composites
-	buffer[0] = true; 
-	buffer[1] = true;
+/* 
+ * every thread reduces a contiguous run of words, the partial results are
+ * merged through a TOP_COUNT sized min-heap
+ */
+Statistics gather_statistics(const OddBitmap * is_composite)
+{
+	prime_t words = is_composite->size();
+	prime_t chunk = (words + THREAD_COUNT - 1) / THREAD_COUNT;
 
+	std::vector<Statistics> partial(THREAD_COUNT);
 	std::vector<std::thread> threads;
+	for (int i = 0; i < THREAD_COUNT; i++)
+	{
+		prime_t first = std::min(i * chunk, words);
+		prime_t last = std::min(first + chunk, words);
+		threads.push_back(std::thread(gather_chunk, is_composite, first, last, &partial[i]));
+	}
+
+	for (auto & t : threads) t.join();
+
+	// 2 is the one prime the bitmap doesn't hold
+	Statistics total;
+	total.count = 1;
+	total.sum = 2;
+
+	std::priority_queue<prime_t, std::vector<prime_t>, std::greater<prime_t>> heap;
+	heap.push(2);
+	for (const Statistics & stats : partial)
+	{
+		total.count += stats.count;
+		total.sum += stats.sum;
+
+		for (prime_t p : stats.top)
+		{
+			heap.push(p);
+			if ((int) heap.size() > TOP_COUNT) heap.pop();
+		}
+	}
+
+	for (; !heap.empty(); heap.pop())
+		total.top.push_back(heap.top());
+
+	return total;
+}
+
+/* 
+ * pi(x) by Meissel's formula, without sieving up to x
+ */
+void count_primes(prime_t x)
+{
+	using namespace std::chrono;
+
+	WorkPool pool(THREAD_COUNT);
+
+	auto start_time = steady_clock::now();
+
+	PrimeCounter counter(x, pool);
+	prime_t total = counter.count(x, pool);
+
+	auto stop_time = steady_clock::now();
+
+	printf("pi(%lu) = %lu\n", x, total);
+	printf("Execution time: %ldms\n",
+			(long) duration_cast<milliseconds>(stop_time - start_time).count());
+}
+
+/* 
+ * grow one sieve through a comma separated list of bounds, each step only
+ * sieving past the previous one
+ */
+void extend_sieve(const char * bounds)
+{
+	using namespace std::chrono;
+
+	IncrementalSieve sieve(0, SEGMENT_SIZE);
+
+	std::vector<char> list(bounds, bounds + strlen(bounds) + 1);
+	for (char * bound = strtok(list.data(), ","); bound; bound = strtok(nullptr, ","))
+	{
+		auto start_time = steady_clock::now();
+		sieve.extend(strtoul(bound, nullptr, 10));
+		auto stop_time = steady_clock::now();
+
+		printf("Extended to %lu: %lu primes, %zu base primes, %ldms\n",
+				sieve.get_hi(), sieve.count(), sieve.base_prime_count(),
+				(long) duration_cast<milliseconds>(stop_time - start_time).count());
+	}
+}
+
+/* 
+ * answer queries from stdin off a table written by -o, one per line:
+ * "is_prime n", "next_prime n" or "count lo hi"
+ */
+int query_table(const char * path)
+{
+	using namespace std::chrono;
+
+	auto start_time = steady_clock::now();
+
+	PrimeTable table;
+	if (!table.open(path))
+	{
+		fprintf(stderr, "%s: not a prime table\n", path);
+		return 1;
+	}
+
+	auto stop_time = steady_clock::now();
+
+	printf("Table: [0, %lu), %lu primes, mapped in %ldus\n",
+			table.get_range(), table.get_prime_count(),
+			(long) duration_cast<microseconds>(stop_time - start_time).count());
+
+	char command[32];
+	prime_t a, b;
+	while (scanf("%31s %lu", command, &a) == 2)
+	{
+		if (strcmp(command, "is_prime") == 0)
+			printf("%s\n", table.is_prime(a) ? "true" : "false");
+		else if (strcmp(command, "next_prime") == 0)
+			printf("%lu\n", table.next_prime(a));
+		else if (strcmp(command, "count") == 0 && scanf("%lu", &b) == 1)
+			printf("%lu\n", table.count(a, b));
+		else
+			printf("?\n");
+	}
+
+	return 0;
+}
+
+void usage(const char * name)
+{
+	printf("usage: %s [-m stride|segmented|partitioned|pool] [-s segment_size] "
+			"[-w 2|6|30|210|2310] [-k fixed|generic] [-g line|page] [-t small|thp|hugetlb] [-a] [-p] "
+			"[-r lo:hi] [-c x] [-o table] [-l table] [-i] [-e hi,hi,...] [-A] [thread_count]\n",
+			name);
+	exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+	using namespace std::chrono;
+
+	int mode = -1;
+	prime_t wheel_size = 210;
+	bool count_events = false;
+	prime_t window_lo = 0;
+	prime_t window_hi = 0;
+	prime_t count_x = 0;
+	int page_mode = -1;
+	const char * table_out = nullptr;
+	const char * table_in = nullptr;
+	bool build_index = false;
+	const char * extend_bounds = nullptr;
+	bool tune = false;
+	bool segment_given = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "m:s:w:k:g:t:apr:c:o:l:ie:A")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm':
+				for (int i = 0; i < MODE_COUNT; i++)
+				{
+					if (strcmp(optarg, MODE_NAMES[i]) == 0) mode = i;
+				}
+				if (mode < 0) usage(argv[0]);
+				break;
+			case 's':
+				SEGMENT_SIZE = strtoul(optarg, nullptr, 10);
+				segment_given = true;
+				break;
+			case 'w': wheel_size = strtoul(optarg, nullptr, 10); break;
+			case 'k':
+				if (strcmp(optarg, "fixed") == 0) segment_sieve = sieve_segment<true>;
+				else if (strcmp(optarg, "generic") == 0) segment_sieve = sieve_segment<false>;
+				else usage(argv[0]);
+				break;
+			case 'g':
+				if (strcmp(optarg, "line") == 0) OWNERSHIP_SPAN = LINE_SPAN;
+				else if (strcmp(optarg, "page") == 0) OWNERSHIP_SPAN = PAGE_SPAN;
+				else usage(argv[0]);
+				break;
+			case 't':
+				for (int i = 0; i < PAGE_MODE_COUNT; i++)
+				{
+					if (strcmp(optarg, PAGE_MODE_NAMES[i]) == 0) page_mode = i;
+				}
+				if (page_mode < 0) usage(argv[0]);
+				break;
+			case 'a': PIN_THREADS = true; break;
+			case 'p': count_events = true; break;
+			case 'r':
+				if (sscanf(optarg, "%lu:%lu", &window_lo, &window_hi) != 2)
+					usage(argv[0]);
+				break;
+			case 'c': count_x = strtoul(optarg, nullptr, 10); break;
+			case 'o': table_out = optarg; break;
+			case 'l': table_in = optarg; break;
+			case 'i': build_index = true; break;
+			case 'e': extend_bounds = optarg; break;
+			case 'A': tune = true; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (mode < 0) mode = STRIDE;
+
+	if (optind < argc)
+		THREAD_COUNT = atoi(argv[optind]);
+
+	if (SEGMENT_SIZE == 0) usage(argv[0]);
+	if (!Wheel::valid(wheel_size)) usage(argv[0]);
+
+	// segments must not share cache lines (or pages)
+	SEGMENT_SIZE = (SEGMENT_SIZE + OWNERSHIP_SPAN - 1)
+		/ OWNERSHIP_SPAN * OWNERSHIP_SPAN;
+
+	if (table_in)
+		return query_table(table_in);
+
+	if (extend_bounds)
+	{
+		extend_sieve(extend_bounds);
+		return 0;
+	}
+
+	if (count_x > 0)
+	{
+		count_primes(count_x);
+		return 0;
+	}
+
+	if (window_hi > window_lo)
+	{
+		stream_window(window_lo, window_hi);
+		return 0;
+	}
+
+	// 0 and 1 are already marked composite by the bitmap. With a page mode
+	// it is left untouched instead, and every word gets stamped by the
+	// thread that sieves it
+	OddBitmap * buffer = page_mode < 0 ? new OddBitmap(PRIME_RANGE)
+		: new OddBitmap(PRIME_RANGE, (PageMode) page_mode);
+
+	wheel = new Wheel(wheel_size);
+
+	// explicit settings win over the tuned ones
+	if (tune)
+	{
+		int threads = THREAD_COUNT;
+		prime_t segment = SEGMENT_SIZE;
+
+		autotune(mode);
+
+		if (optind < argc) THREAD_COUNT = threads;
+		if (segment_given) SEGMENT_SIZE = segment;
+
+		// segments must not share cache lines (or pages)
+		SEGMENT_SIZE = (SEGMENT_SIZE + OWNERSHIP_SPAN - 1)
+			/ OWNERSHIP_SPAN * OWNERSHIP_SPAN;
+	}
+
+	// must be opened before the threads exist to follow them
+	PerfCounters * events = count_events ? new PerfCounters() : nullptr;
+	if (events)
+	{
+		// what the page modes are meant to change
+		events->add("dTLB-load-misses", PERF_TYPE_HW_CACHE, PerfCounters::cache_event(
+					PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+					PERF_COUNT_HW_CACHE_RESULT_MISS));
+		events->add("node-load-misses", PERF_TYPE_HW_CACHE, PerfCounters::cache_event(
+					PERF_COUNT_HW_CACHE_NODE, PERF_COUNT_HW_CACHE_OP_READ,
+					PERF_COUNT_HW_CACHE_RESULT_MISS));
+	}
+
+	WorkPool * pool = mode == POOLED ? new WorkPool(THREAD_COUNT) : nullptr;
+	if (pool && PIN_THREADS) pool->pin();
 
 	printf("Spawning threads...\n");
 
 	// mark time
-	auto start_time = system_clock::now();
+	auto start_time = steady_clock::now();
+	if (events) events->start();
 
 	// --- Run algorithm -------------------------------------------------------
 
-	for (int i = 0; i < THREAD_COUNT; i++)
-		threads.push_back(std::thread(sieve, i, buffer));
-
-	for (auto & t : threads) t.join();
+	run_sieve(mode, buffer, pool, page_mode >= 0);
 
 	// mark time
-	auto stop_time = system_clock::now();
+	if (events) events->stop();
+	auto stop_time = steady_clock::now();
 
-	int time = duration_cast<milliseconds>(stop_time - start_time).count();
+	long time = duration_cast<milliseconds>(stop_time - start_time).count();
 
 	// --- Compute statistics --------------------------------------------------
 
-	long total = 0;
-	prime_t sum = 0;
-
-	prime_t top_primes[10];
+	auto stats_start = steady_clock::now();
+	Statistics stats = gather_statistics(buffer);
+	auto stats_stop = steady_clock::now();
 
-	for (int i = PRIME_RANGE - 1; i >= 0; i--)
+	printf("Mode: %s (wheel %lu)\n", MODE_NAMES[mode], wheel_size);
+	if (page_mode >= 0)
 	{
-		if (!buffer[i])
-		{
-			// i is a prime
-			sum += i;
-			total++;
+		printf("Pages: %s%s\n", PAGE_MODE_NAMES[buffer->get_page_mode()],
+				PIN_THREADS ? ", pinned" : "");
+		report_placement(buffer->data(), buffer->size() * sizeof(uint64_t));
+	}
+	printf("Execution time: %ldms\n", time);
+	printf("Statistics time: %ldms\n",
+			(long) duration_cast<milliseconds>(stats_stop - stats_start).count());
+	printf("Prime count: %lu\n", stats.count);
+	printf("Sum of primes: %lu\n", stats.sum);
+	printf("Top %d primes (least to greatest): \n", TOP_COUNT);
+	for (size_t i = 0; i < stats.top.size(); i++)
+		printf("[%zu] : %lu\n", i + 1, stats.top[i]);
+
+	if (build_index)
+	{
+		WorkPool * index_pool = pool ? pool : new WorkPool(THREAD_COUNT);
 
-			if (total <= 10)
-			{
-				top_primes[10 - total] = i;
-			}
-		}
+		auto index_start = steady_clock::now();
+		RankIndex index(*buffer, *index_pool);
+		auto index_stop = steady_clock::now();
+
+		printf("Rank index: %ldus, %zu bytes (%.2f%% of the bitmap)\n",
+				(long) duration_cast<microseconds>(index_stop - index_start).count(),
+				index.memory(), 100.0 * index.memory() / (buffer->size() * sizeof(uint64_t)));
+		printf("  primes in [%lu, %lu): %lu\n", PRIME_RANGE / 2, PRIME_RANGE,
+				index.count(PRIME_RANGE / 2, PRIME_RANGE));
+		printf("  nth_prime(%lu): %lu\n", stats.count, index.nth_prime(stats.count));
+
+		if (index_pool != pool) delete index_pool;
 	}
 
-	printf("Execution time: %dms\n", time);
-	printf("Prime count: %d\n", total);
-	printf("Sum of primes: %lu\n", sum);
-	printf("Top 10 primes (least to greatest): \n");
-	for (int i = 0; i < 10; i++)
-		printf("[%d] : %lu\n", i + 1, top_primes[i]);
+	if (table_out && !PrimeTable::write(table_out, *buffer))
+		fprintf(stderr, "%s: could not write the prime table\n", table_out);
+
+	if (pool)
+	{
+		pool->report();
+		delete pool;
+	}
+
+	if (events)
+	{
+		events->report(PRIME_RANGE / 1e6, "million integers");
+		delete events;
+	}
 
-	delete [] buffer;
+	delete buffer;
+	delete wheel;
 
 	return 0;
 }
@@ -0,0 +1,222 @@
+#ifndef PRIMECOUNT_H
+#define PRIMECOUNT_H
+
+#include <atomic>
+#include <vector>
+
+#include <cmath>
+#include <cstdint>
+
+#include "pool.h"
+#include "primestream.h"
+
+/*
+ * pi(x) without enumerating the primes below x, by Meissel's formula
+ *
+ *   pi(x) = phi(x, a) + a - 1 - P2(x, a),   a = pi(x^1/3)
+ *   P2(x, a) = sum over a < i <= pi(sqrt x) of pi(x / p_i) - (i - 1)
+ *
+ * where phi(x, a) counts the n <= x with no prime factor among the first a
+ * primes. Everything P2 and the leaves of phi need from pi() comes from a
+ * sieved table up to x^2/3 (a bit per odd number plus a running count per
+ * word), so the only real work is the phi recursion. Both phi (split into
+ * one task per top level leaf) and P2 run on the work-stealing pool.
+ */
+class PrimeCounter
+{
+	// --- pi() table up to [limit] -------------------------------------------
+	prime_t limit;
+	std::vector<uint64_t> is_prime; // bit i of word w: 128 w + 2 i + 1
+	std::vector<uint32_t> before;   // odd primes in the words before w
+
+	// primes[i] is the i-th prime (1 based), up to a bit past sqrt(max x)
+	std::vector<prime_t> primes;
+
+	// phi(n, a) for a <= SMALL_A is periodic mod 2 * 3 * ... * p_a
+	static const int SMALL_A = 6;
+	prime_t products[SMALL_A + 1];
+	std::vector<uint16_t> small_phi[SMALL_A + 1];
+
+	public:
+
+	/* builds a table good for any x up to [max_x] */
+	PrimeCounter(prime_t max_x, WorkPool & pool)
+	{
+		prime_t root = isqrt(max_x);
+		prime_t cube = icbrt(max_x) + 1;
+
+		limit = std::max<prime_t>(cube * cube, root + 4096);
+		limit = (limit + 127) / 128 * 128;
+
+		build_table(pool);
+
+		// phi() looks one prime past pi(sqrt x), the small tables need p_SMALL_A
+		prime_t needed = std::max<prime_t>(pi_table(root) + 1, SMALL_A);
+
+		primes.push_back(0);
+		primes.push_back(2);
+		for (prime_t n = 3; n < limit && primes.size() <= needed; n += 2)
+		{
+			if (table_bit(n)) primes.push_back(n);
+		}
+
+		build_small_phi();
+	}
+
+	/* number of primes <= x, x must not be past max_x */
+	prime_t count(prime_t x, WorkPool & pool)
+	{
+		if (x < limit) return pi_table(x);
+
+		prime_t a = pi_table(icbrt(x));
+		prime_t b = pi_table(isqrt(x));
+
+		int64_t result = phi_parallel(x, a, pool) + a - 1;
+
+		// --- P2, one task per block of i -----------------------------------------
+		std::atomic<int64_t> p2(0);
+		const prime_t BLOCK = 256;
+		for (prime_t lo = a + 1; lo <= b; lo += BLOCK)
+		{
+			pool.submit([=, &p2](int)
+			{
+				int64_t sum = 0;
+				for (prime_t i = lo; i <= b && i < lo + BLOCK; i++)
+					sum += pi_table(x / primes[i]) - (i - 1);
+				p2 += sum;
+			});
+		}
+		pool.wait();
+
+		return result - p2;
+	}
+
+	/* pi(n) for n below the table's limit */
+	prime_t pi_table(prime_t n) const
+	{
+		if (n < 3) return n == 2;
+
+		prime_t bit = (n - 1) / 2;
+		prime_t w = bit / 64;
+		uint64_t mask = ~uint64_t(0) >> (63 - bit % 64);
+
+		return 1 + before[w] + __builtin_popcountll(is_prime[w] & mask);
+	}
+
+	prime_t get_limit() const { return limit; }
+
+	static prime_t isqrt(prime_t x)
+	{
+		prime_t r = (prime_t) sqrtl((long double) x);
+		while (r * r > x) r--;
+		while ((r + 1) * (r + 1) <= x) r++;
+		return r;
+	}
+
+	static prime_t icbrt(prime_t x)
+	{
+		prime_t r = (prime_t) cbrtl((long double) x);
+		while (r * r * r > x) r--;
+		while ((r + 1) * (r + 1) * (r + 1) <= x) r++;
+		return r;
+	}
+
+	private:
+
+	bool table_bit(prime_t n) const
+	{
+		prime_t bit = (n - 1) / 2;
+		return is_prime[bit / 64] >> (bit % 64) & 1;
+	}
+
+	/* sieve [0, limit) in parallel windows, each one owning whole words */
+	void build_table(WorkPool & pool)
+	{
+		prime_t words = limit / 128;
+		is_prime.assign(words, 0);
+		before.assign(words, 0);
+
+		const prime_t WINDOW = 1 << 24;
+		for (prime_t lo = 0; lo < limit; lo += WINDOW)
+		{
+			prime_t hi = std::min(lo + WINDOW, limit);
+			pool.submit([=](int)
+			{
+				PrimeStream stream(lo, hi);
+				stream.for_each([&](prime_t p)
+				{
+					if (p == 2) return;
+					prime_t bit = (p - 1) / 2;
+					is_prime[bit / 64] |= uint64_t(1) << (bit % 64);
+				});
+			});
+		}
+		pool.wait();
+
+		uint32_t running = 0;
+		for (prime_t w = 0; w < words; w++)
+		{
+			before[w] = running;
+			running += __builtin_popcountll(is_prime[w]);
+		}
+	}
+
+	void build_small_phi()
+	{
+		products[0] = 1;
+
+		for (int a = 1; a <= SMALL_A; a++)
+		{
+			products[a] = products[a - 1] * primes[a];
+
+			// small_phi[a][r] = phi(r, a)
+			std::vector<uint16_t> & table = small_phi[a];
+			table.assign(products[a], 0);
+			for (prime_t r = 1; r < products[a]; r++)
+			{
+				bool coprime = true;
+				for (int i = 1; i <= a; i++)
+					coprime = coprime && r % primes[i] != 0;
+
+				table[r] = table[r - 1] + coprime;
+			}
+		}
+	}
+
+	int64_t phi(prime_t x, prime_t a) const
+	{
+		if (a == 0) return x;
+		if (a <= (prime_t) SMALL_A)
+		{
+			// every whole period P holds phi(P - 1, a) survivors
+			prime_t period = products[a];
+			return (x / period) * small_phi[a][period - 1] + small_phi[a][x % period];
+		}
+
+		// nothing below p_(a+1)^2 but 1 and primes survives
+		if (x < limit && x < primes[a + 1] * primes[a + 1])
+			return x < primes[a + 1] ? (x >= 1) : (int64_t) pi_table(x) - a + 1;
+
+		return phi(x, a - 1) - phi(x / primes[a], a - 1);
+	}
+
+	/* phi(x, a) = phi(x, SMALL_A) - sum of phi(x / p_i, i - 1), one task each */
+	int64_t phi_parallel(prime_t x, prime_t a, WorkPool & pool)
+	{
+		if (a <= (prime_t) SMALL_A) return phi(x, a);
+
+		std::atomic<int64_t> leaves(0);
+		for (prime_t i = a; i > (prime_t) SMALL_A; i--)
+		{
+			pool.submit([=, &leaves](int)
+			{
+				leaves += phi(x / primes[i], i - 1);
+			});
+		}
+		pool.wait();
+
+		return phi(x, SMALL_A) - leaves;
+	}
+};
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef PRIMESTREAM_H
+#define PRIMESTREAM_H
+
+#include <algorithm>
+#include <vector>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "bitmap.h"
+
+/*
+ * streams the primes of an arbitrary window [lo, hi) in ascending order,
+ * one segment at a time. Memory stays at one odd-only segment plus the
+ * base primes up to sqrt(hi) and the next multiple of each, no matter how
+ * wide or how far out the window is.
+ *
+ *   PrimeStream stream(lo, hi);
+ *   for (prime_t p; (p = stream.next()) != 0;) ...
+ *
+ * or stream.for_each(callback) to drain it in one go.
+ *
+ * Base primes whose odd stride 2p is at least a segment hit any segment at
+ * most once. Rather than visiting each of them for every segment they are
+ * kept in buckets (Oliveira e Silva's bucket sieve): a ring with one bucket
+ * per segment ahead, each prime sitting in the bucket of the segment its
+ * next multiple falls in. A segment only drains its own bucket, so the cost
+ * is the number of hits rather than the number of large primes.
+ */
+class PrimeStream
+{
+	prime_t lo;
+	prime_t hi;
+
+	// integers per segment (a multiple of 128, so a whole number of words)
+	prime_t segment_size;
+
+	// odd base primes and, for the small ones, the next odd multiple of each
+	// still to cross off
+	std::vector<prime_t> base_primes;
+	std::vector<prime_t> next_multiple;
+
+	// base_primes[small_count..] go into buckets, once their square is reached
+	size_t small_count;
+	size_t next_large;
+
+	struct Entry
+	{
+		prime_t prime;
+		prime_t multiple;
+	};
+
+	// bucket (segment index % buckets.size()) holds the primes hitting it
+	std::vector<std::vector<Entry>> buckets;
+	prime_t segment_index;
+
+	// the current segment [seg_lo, seg_hi), bit set = composite
+	std::vector<uint64_t> segment;
+	prime_t seg_lo;
+	prime_t seg_hi;
+
+	// read position inside the segment
+	prime_t word;
+	uint64_t pending;
+
+	bool emit_two;
+
+	public:
+
+	PrimeStream(prime_t _lo, prime_t _hi, prime_t _segment_size = 1 << 20,
+			bool bucketed = true)
+	{
+		lo = _lo;
+		hi = _hi;
+		segment_size = std::max<prime_t>(_segment_size / 128 * 128, 128);
+
+		emit_two = lo <= 2 && hi > 2;
+
+		// --- Base primes up to sqrt(hi) --------------------------------------
+		prime_t root = (prime_t) sqrtl((long double) hi);
+		while (root * root > hi) root--;
+		while ((root + 1) * (root + 1) <= hi) root++;
+
+		std::vector<bool> is_composite(root + 1, false);
+		for (prime_t p = 3; p <= root; p += 2)
+		{
+			if (is_composite[p]) continue;
+
+			base_primes.push_back(p);
+			for (prime_t i = p * p; i <= root; i += 2 * p)
+				is_composite[i] = true;
+		}
+
+		// --- Split at a stride of one segment ---------------------------------
+		small_count = base_primes.size();
+		if (bucketed)
+		{
+			small_count = std::lower_bound(base_primes.begin(), base_primes.end(),
+					segment_size / 2) - base_primes.begin();
+
+			// a large prime's next multiple is never more than 2p / segment_size
+			// segments ahead
+			buckets.resize(2 * root / segment_size + 2);
+		}
+		next_large = small_count;
+		segment_index = 0;
+
+		// --- First odd multiple at or past the window (but never p itself) ---
+		seg_lo = lo & ~(prime_t) 1;
+		for (size_t i = 0; i < small_count; i++)
+			next_multiple.push_back(first_multiple(base_primes[i]));
+
+		segment.resize(segment_size / 128);
+		seg_hi = seg_lo;
+		word = segment.size();
+		pending = 0;
+	}
+
+	/* next prime in the window, or 0 once it's exhausted */
+	prime_t next()
+	{
+		if (emit_two)
+		{
+			emit_two = false;
+			return 2;
+		}
+
+		for (;;)
+		{
+			if (pending != 0)
+			{
+				prime_t n = seg_lo + word * 128 + 2 * __builtin_ctzll(pending) + 1;
+				pending &= pending - 1;
+
+				if (n >= hi) return 0;
+				if (n >= lo) return n;
+				continue;
+			}
+
+			if (++word < segment.size())
+			{
+				pending = ~segment[word];
+				continue;
+			}
+
+			if (seg_hi >= hi) return 0;
+			sieve_next_segment();
+		}
+	}
+
+	template <class F>
+	void for_each(F callback)
+	{
+		for (prime_t p; (p = next()) != 0;)
+			callback(p);
+	}
+
+	private:
+
+	prime_t first_multiple(prime_t p) const
+	{
+		prime_t m = std::max(p * p, (seg_lo + p - 1) / p * p);
+		if (m % 2 == 0) m += p;
+		return m;
+	}
+
+	void sieve_next_segment()
+	{
+		seg_lo = seg_hi;
+		seg_hi = seg_lo + segment_size;
+
+		memset(segment.data(), 0, segment.size() * sizeof(uint64_t));
+
+		// 1 is not a prime
+		if (seg_lo == 0) segment[0] |= 1;
+
+		for (size_t i = 0; i < small_count; i++)
+		{
+			prime_t p = base_primes[i];
+			prime_t m = next_multiple[i];
+
+			for (; m < seg_hi; m += 2 * p)
+			{
+				prime_t bit = (m - seg_lo) >> 1;
+				segment[bit >> 6] |= uint64_t(1) << (bit & 63);
+			}
+
+			next_multiple[i] = m;
+		}
+
+		if (!buckets.empty()) sieve_buckets();
+
+		word = 0;
+		pending = ~segment[0];
+	}
+
+	/* bucket position of a multiple, relative to the current segment */
+	std::vector<Entry> & bucket_of(prime_t m)
+	{
+		return buckets[(segment_index + (m - seg_lo) / segment_size) % buckets.size()];
+	}
+
+	/* cross off this segment's large prime hits and rebucket them */
+	void sieve_buckets()
+	{
+		// large primes whose square falls in here start now, their first
+		// multiple is within 2p of the segment (or in it)
+		for (; next_large < base_primes.size(); next_large++)
+		{
+			prime_t p = base_primes[next_large];
+			if (p * p >= seg_hi) break;
+
+			prime_t m = first_multiple(p);
+			if (m < hi) bucket_of(m).push_back({ p, m });
+		}
+
+		std::vector<Entry> & bucket = buckets[segment_index % buckets.size()];
+		for (size_t i = 0; i < bucket.size(); i++)
+		{
+			Entry e = bucket[i];
+
+			prime_t bit = (e.multiple - seg_lo) >> 1;
+			segment[bit >> 6] |= uint64_t(1) << (bit & 63);
+
+			// 2p >= segment_size, so this lands in a later segment's bucket
+			e.multiple += 2 * e.prime;
+			if (e.multiple < hi) bucket_of(e.multiple).push_back(e);
+		}
+		bucket.clear();
+
+		segment_index++;
+	}
+};
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef PRIMETABLE_H
+#define PRIMETABLE_H
+
+#include <algorithm>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+
+/*
+ * read-only prime table on disk, mapped straight into memory so a lookup
+ * service starts in microseconds instead of re-sieving.
+ *
+ *   Header                                        48 bytes
+ *   uint64_t counts[block_count + 1]              odd primes before block b
+ *   uint64_t words[word_count]                    OddBitmap words, as sieved
+ *
+ * The words are the sieve's own odd-only bitmap (bit set = composite, 1 and
+ * the padding marked), the counts index it every BLOCK_WORDS words, so
+ * count() popcounts at most one block.
+ */
+class PrimeTable
+{
+	public:
+
+	static const uint32_t VERSION = 1;
+
+	// 512K integers per index entry
+	static const uint32_t BLOCK_WORDS = 4096;
+
+	private:
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t block_words;
+		uint64_t range;
+		uint64_t word_count;
+		uint64_t block_count;
+		uint64_t prime_count;
+	};
+
+	void * map;
+	size_t map_size;
+
+	const Header * header;
+	const uint64_t * counts;
+	const uint64_t * words;
+
+	static constexpr char MAGIC[8] = { 'P', 'R', 'I', 'M', 'E', 'T', 'B', 'L' };
+
+	public:
+
+	PrimeTable() : map(nullptr), map_size(0), header(nullptr), counts(nullptr), words(nullptr)
+	{
+	}
+
+	PrimeTable(const PrimeTable &) = delete;
+	PrimeTable & operator=(const PrimeTable &) = delete;
+
+	~PrimeTable()
+	{
+		close();
+	}
+
+	/* write a fully sieved bitmap out as a table, false on any i/o error */
+	static bool write(const char * path, const OddBitmap & bitmap)
+	{
+		const uint64_t * bits = bitmap.data();
+
+		Header h;
+		memcpy(h.magic, MAGIC, sizeof(MAGIC));
+		h.version = VERSION;
+		h.block_words = BLOCK_WORDS;
+		h.range = bitmap.get_range();
+		h.word_count = bitmap.size();
+		h.block_count = (h.word_count + BLOCK_WORDS - 1) / BLOCK_WORDS;
+		h.prime_count = bitmap.count();
+
+		FILE * file = fopen(path, "wb");
+		if (file == nullptr) return false;
+
+		bool ok = fwrite(&h, sizeof(h), 1, file) == 1;
+
+		uint64_t running = 0;
+		for (uint64_t b = 0; b <= h.block_count && ok; b++)
+		{
+			ok = fwrite(&running, sizeof(running), 1, file) == 1;
+
+			uint64_t last = std::min<uint64_t>((b + 1) * BLOCK_WORDS, h.word_count);
+			for (uint64_t w = b * BLOCK_WORDS; w < last; w++)
+				running += __builtin_popcountll(~bits[w]);
+		}
+
+		ok = ok && fwrite(bits, sizeof(uint64_t), h.word_count, file) == h.word_count;
+
+		return fclose(file) == 0 && ok;
+	}
+
+	/* map a table read-only, false if it's missing or not a valid table */
+	bool open(const char * path)
+	{
+		close();
+
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Header))
+		{
+			::close(fd);
+			return false;
+		}
+
+		map_size = st.st_size;
+		map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (map == MAP_FAILED)
+		{
+			map = nullptr;
+			return false;
+		}
+
+		header = (const Header *) map;
+		counts = (const uint64_t *) (header + 1);
+		words = counts + header->block_count + 1;
+
+		bool valid = memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0
+			&& header->version == VERSION
+			&& header->block_words == BLOCK_WORDS
+			&& header->word_count == (header->range + OddBitmap::WORD_SPAN - 1) / OddBitmap::WORD_SPAN
+			&& header->block_count == (header->word_count + BLOCK_WORDS - 1) / BLOCK_WORDS
+			&& map_size == sizeof(Header)
+				+ (header->block_count + 1 + header->word_count) * sizeof(uint64_t);
+
+		if (!valid) close();
+		return valid;
+	}
+
+	void close()
+	{
+		if (map) munmap(map, map_size);
+
+		map = nullptr;
+		header = nullptr;
+	}
+
+	/* the table covers [0, range) */
+	prime_t get_range() const { return header->range; }
+	prime_t get_prime_count() const { return header->prime_count; }
+
+	bool is_prime(prime_t n) const
+	{
+		if (n % 2 == 0) return n == 2;
+		if (n >= header->range) return false;
+
+		return !(words[n / OddBitmap::WORD_SPAN] & OddBitmap::bit(n));
+	}
+
+	/* smallest prime > n, or 0 if there is none in the table */
+	prime_t next_prime(prime_t n) const
+	{
+		if (n < 2) return header->range > 2 ? 2 : 0;
+
+		// first odd number past n
+		prime_t b = (n + 1) >> 1;
+		prime_t w = b / 64;
+		if (w >= header->word_count) return 0;
+
+		uint64_t primes = ~words[w] & (~uint64_t(0) << (b % 64));
+		for (;;)
+		{
+			if (primes != 0)
+				return w * OddBitmap::WORD_SPAN + 2 * __builtin_ctzll(primes) + 1;
+
+			if (++w == header->word_count) return 0;
+			primes = ~words[w];
+		}
+	}
+
+	/* number of primes in [lo, hi) */
+	prime_t count(prime_t lo, prime_t hi) const
+	{
+		if (hi <= lo) return 0;
+		return rank(hi) - rank(lo);
+	}
+
+	private:
+
+	/* number of primes below n */
+	prime_t rank(prime_t n) const
+	{
+		if (n > header->range) n = header->range;
+		if (n <= 2) return 0;
+
+		// the odd numbers below n are exactly bits [0, n / 2)
+		prime_t bits = n >> 1;
+		prime_t w = bits / 64;
+		prime_t block = w / BLOCK_WORDS;
+
+		prime_t total = 1 + counts[block];
+		for (prime_t i = block * BLOCK_WORDS; i < w; i++)
+			total += __builtin_popcountll(~words[i]);
+
+		if (bits % 64 != 0)
+			total += __builtin_popcountll(~words[w] & ((uint64_t(1) << (bits % 64)) - 1));
+
+		return total;
+	}
+};
+
+#endif
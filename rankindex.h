@@ -0,0 +1,169 @@
+#ifndef RANKINDEX_H
+#define RANKINDEX_H
+
+#include <vector>
+
+#include <cstdint>
+
+#include "bitmap.h"
+#include "pool.h"
+
+/*
+ * succinct rank / select index over a finished OddBitmap.
+ *
+ * Two levels of cumulative prime counts: an absolute count before every
+ * superblock of 64 words and a 16-bit count relative to the superblock
+ * before every block of 16 words. A rank is two lookups plus at most 15
+ * popcounts, about 3% on top of the bitmap. Select starts from a sampled
+ * superblock (one per SELECT_SAMPLE primes) and walks forward from there.
+ *
+ * The index reads the bitmap, it doesn't copy it: the bitmap has to
+ * outlive the index and must not change under it.
+ */
+class RankIndex
+{
+	static const prime_t BLOCK_WORDS = 16;
+	static const prime_t SUPER_WORDS = 64;
+	static const prime_t BLOCKS_PER_SUPER = SUPER_WORDS / BLOCK_WORDS;
+
+	static const prime_t SELECT_SAMPLE = 8192;
+
+	const OddBitmap & bitmap;
+	const uint64_t * words;
+	prime_t word_count;
+
+	// odd primes before superblock s (one extra entry, the total)
+	std::vector<uint64_t> super_counts;
+	// odd primes between the start of the superblock and block b
+	std::vector<uint16_t> block_counts;
+	// superblock holding odd prime i * SELECT_SAMPLE + 1
+	std::vector<uint32_t> samples;
+
+	public:
+
+	/* build with one task per run of superblocks on the pool */
+	RankIndex(const OddBitmap & _bitmap, WorkPool & pool) : bitmap(_bitmap)
+	{
+		words = bitmap.data();
+		word_count = bitmap.size();
+
+		prime_t supers = (word_count + SUPER_WORDS - 1) / SUPER_WORDS;
+		super_counts.assign(supers + 1, 0);
+		block_counts.assign(supers * BLOCKS_PER_SUPER, 0);
+
+		// --- Per superblock counts, in parallel ----------------------------------
+		const prime_t TASK_SUPERS = 1024;
+		for (prime_t first = 0; first < supers; first += TASK_SUPERS)
+		{
+			prime_t last = std::min(first + TASK_SUPERS, supers);
+			pool.submit([=](int)
+			{
+				for (prime_t s = first; s < last; s++)
+				{
+					uint64_t in_super = 0;
+					for (prime_t b = 0; b < BLOCKS_PER_SUPER; b++)
+					{
+						block_counts[s * BLOCKS_PER_SUPER + b] = in_super;
+
+						prime_t w = (s * BLOCKS_PER_SUPER + b) * BLOCK_WORDS;
+						prime_t end = std::min(w + BLOCK_WORDS, word_count);
+						for (; w < end; w++)
+							in_super += __builtin_popcountll(~words[w]);
+					}
+
+					super_counts[s + 1] = in_super;
+				}
+			});
+		}
+		pool.wait();
+
+		// --- Prefix sums and select samples (one entry per superblock) -----------
+		for (prime_t s = 0; s < supers; s++)
+		{
+			super_counts[s + 1] += super_counts[s];
+
+			// samples whose prime falls in this superblock
+			while (samples.size() * SELECT_SAMPLE < super_counts[s + 1])
+				samples.push_back(s);
+		}
+	}
+
+	RankIndex(const RankIndex &) = delete;
+	RankIndex & operator=(const RankIndex &) = delete;
+
+	/* number of primes below n */
+	prime_t rank(prime_t n) const
+	{
+		if (n > bitmap.get_range()) n = bitmap.get_range();
+		if (n <= 2) return 0;
+
+		// the odd numbers below n are exactly bits [0, n / 2)
+		prime_t bits = n >> 1;
+		prime_t w = bits / 64;
+		prime_t block = w / BLOCK_WORDS;
+
+		prime_t total = 1 + super_counts[w / SUPER_WORDS];
+		if (block < block_counts.size()) total += block_counts[block];
+
+		for (prime_t i = block * BLOCK_WORDS; i < w; i++)
+			total += __builtin_popcountll(~words[i]);
+
+		if (bits % 64 != 0)
+			total += __builtin_popcountll(~words[w] & ((uint64_t(1) << (bits % 64)) - 1));
+
+		return total;
+	}
+
+	/* number of primes in [lo, hi) */
+	prime_t count(prime_t lo, prime_t hi) const
+	{
+		if (hi <= lo) return 0;
+		return rank(hi) - rank(lo);
+	}
+
+	/* the k-th prime (nth_prime(1) = 2), or 0 if the bitmap holds fewer */
+	prime_t nth_prime(prime_t k) const
+	{
+		if (k == 0 || k > total()) return 0;
+		if (k == 1) return 2;
+
+		// the r-th odd prime, 1 based
+		uint64_t r = k - 1;
+
+		prime_t s = samples[(r - 1) / SELECT_SAMPLE];
+		while (super_counts[s + 1] < r) s++;
+		r -= super_counts[s];
+
+		prime_t b = s * BLOCKS_PER_SUPER;
+		while (b + 1 < (s + 1) * BLOCKS_PER_SUPER && block_counts[b + 1] < r) b++;
+		r -= block_counts[b];
+
+		for (prime_t w = b * BLOCK_WORDS;; w++)
+		{
+			uint64_t primes = ~words[w];
+			uint64_t in_word = __builtin_popcountll(primes);
+			if (in_word < r)
+			{
+				r -= in_word;
+				continue;
+			}
+
+			// drop the r - 1 lowest primes of the word
+			for (; r > 1; r--) primes &= primes - 1;
+			return w * OddBitmap::WORD_SPAN + 2 * __builtin_ctzll(primes) + 1;
+		}
+	}
+
+	/* primes in the whole bitmap */
+	prime_t total() const { return 1 + super_counts.back(); }
+
+	/* bytes held by the index itself */
+	size_t memory() const
+	{
+		return super_counts.size() * sizeof(uint64_t)
+			+ block_counts.size() * sizeof(uint16_t)
+			+ samples.size() * sizeof(uint32_t);
+	}
+};
+
+#endif
@@ -1,112 +1,104 @@
 #include <atomic>
-#include <memory>
+#include <chrono>
 #include <thread>
 
+#include <cstdint>
 #include <cstdio>  // printf()
 #include <cstdlib> // rand();
 #include <ctime>   // to seed rand();
 
+#include "elimination.h"
+#include "nodepool.h"
+
 template <class T>
 class Stack
 {
 	public:
 
-	struct Node
+	// a line each, threads pushing neighbours don't share one
+	struct alignas(64) Node
 	{
 		T val;
 		Node * next;
 	};
 
+	typedef ::NodePool<Node> NodePool;
 
-	class NodePool
+	/*
+	 * descriptor, packed into the 16 bytes a single cmpxchg16b swaps: the
+	 * head, and the size (low half) next to a tag (high half) in one word.
+	 * The tag changes on every swap, so a head that was popped and pushed
+	 * back with the same size still doesn't match
+	 */
+	struct alignas(16) Descriptor
 	{
-		int size;
-		Node * pool;
-
-		int used;
+		Node * head;
+		uint64_t count;
 
-		public:
+		uint32_t size() const { return (uint32_t) count; }
 
-		NodePool(int _size)
+		/* same head moved by [delta] nodes, next tag */
+		uint64_t next(int delta) const
 		{
-			used = 0;
-			size = _size;
-			pool = new Node[size];
+			uint32_t tag = count >> 32;
+			return (uint32_t) (size() + delta) | (uint64_t) (tag + 1) << 32;
 		}
+	};
 
-		Node * get(int val)
-		{
-			if (used >= size) return nullptr;
-
-			Node * node = pool + used;
-			used++;
+	private:
 
-			node->val = val;
+	std::atomic<int> numOps;
 
-			return node;
-		}
+	Descriptor desc;
 
-		~NodePool()
-		{
-			delete [] pool;
-		}
-	};
+	// where a push and a pop that lost the race for desc can meet instead
+	EliminationArray<Node> elimination;
 
-	/* descriptor */
-	struct Descriptor
+	/* lock cmpxchg16b on [desc], [expected] is refreshed on failure */
+	bool swap(Descriptor & expected, Descriptor desired)
 	{
-		Node * head;
-		int size;
-	};
-
-	private:
-
-	std::atomic<int> numOps;
+		bool ok;
+		__asm__ __volatile__("lock cmpxchg16b %1"
+				: "=@ccz" (ok), "+m" (desc), "+a" (expected.head), "+d" (expected.count)
+				: "b" (desired.head), "c" (desired.count)
+				: "memory");
+		return ok;
+	}
 
-	std::shared_ptr<Descriptor> desc;
+	/* the two words may tear, which only fails the next swap */
+	Descriptor load() const
+	{
+		Descriptor d;
+		d.count = __atomic_load_n(&desc.count, __ATOMIC_ACQUIRE);
+		d.head = __atomic_load_n(&desc.head, __ATOMIC_ACQUIRE);
+		return d;
+	}
 
 	public:
 
 	Stack()
 	{
-		std::shared_ptr<Descriptor> newDesc = std::make_shared<Descriptor>();
-		newDesc->head = nullptr;
-		newDesc->size = 0;
-
-		std::atomic_store(&desc, newDesc);
+		desc = { nullptr, 0 };
 
 		numOps = 0;
 	}
 
-	std::shared_ptr<Descriptor> buildDescriptor(Node * head, int size)
-	{
-		std::shared_ptr<Descriptor> newDesc = std::make_shared<Descriptor>();
-		newDesc->head = nullptr;
-		newDesc->size = 0;
-		return newDesc;
-	}
-
 	// pushes raw node (for preallocated nodes)
 	bool push(Node * newNode)
 	{
 		if (newNode == nullptr) return false;
 
-		bool succ;
-		do
+		Descriptor curDesc = load();
+		for (;;)
 		{
-			std::shared_ptr<Descriptor> curDesc = std::atomic_load(&desc);
-
 			// setup new node
-			newNode->next = curDesc->head;
-
-			// build new descriptor
-			std::shared_ptr<Descriptor> newDesc = std::make_shared<Descriptor>();
-			newDesc->head = newNode;
-			newDesc->size = curDesc->size + 1;
+			newNode->next = curDesc.head;
+			if (swap(curDesc, { newNode, curDesc.next(+1) })) break;
 
-			// attempt to swap in new descriptor
-			succ = std::atomic_compare_exchange_strong(&desc, &curDesc, newDesc);
-		} while (!succ);
+			// contended, hand it straight to a pop if one comes by
+			if (elimination.push(newNode)) break;
+			curDesc = load();
+		}
 
 		++numOps;
 		return true;
@@ -115,38 +107,40 @@ class Stack
 	// returns node (don't handle node destruction)
 	Node * pop()
 	{
-		Node * popped;
-		bool succ;
-		do
+		Descriptor curDesc = load();
+		for (;;)
 		{
-			std::shared_ptr<Descriptor> curDesc = std::atomic_load(&desc);
-
-			popped = curDesc->head;
+			Node * popped = curDesc.head;
 
 			if (popped == nullptr) 
 				return nullptr;
 
-			Node * newHead = popped->next;
-
-			// build new descriptor
-			std::shared_ptr<Descriptor> newDesc = std::make_shared<Descriptor>();
-			newDesc->head = newHead;
-			newDesc->size = curDesc->size - 1;
-
-			succ = std::atomic_compare_exchange_strong(&desc, &curDesc, newDesc);
-		} while(!succ);
+			// nodes are never freed while the stack runs, a stale read of a
+			// recycled node is caught by the tag
+			Node * newHead = __atomic_load_n(&popped->next, __ATOMIC_RELAXED);
 
-		++numOps;
+			if (swap(curDesc, { newHead, curDesc.next(-1) }))
+			{
+				++numOps;
+				return popped;
+			}
 
-		return popped;
+			// contended, take a node a push is offering if there is one
+			if ((popped = elimination.pop()) != nullptr)
+			{
+				++numOps;
+				return popped;
+			}
+			curDesc = load();
+		}
 	}
 
 	int size()
 	{
-		std::shared_ptr<Descriptor> curDesc = std::atomic_load(&desc);
-
 		++numOps;
-		return curDesc->size;
+
+		// a single word, no need for the head
+		return (uint32_t) __atomic_load_n(&desc.count, __ATOMIC_ACQUIRE);
 	}
 
 
@@ -155,6 +149,11 @@ class Stack
 		return (int) numOps;
 	}
 
+	long getEliminated() const
+	{
+		return elimination.getEliminated();
+	}
+
 	~Stack()
 	{
 		// we don't manage the nodes
@@ -163,22 +162,22 @@ class Stack
 
 const int TEST_OPS = 150'000;
 
+int THREAD_COUNT = 4;
+
 struct Tester
 {
 	Stack<int> * stack;
 	std::thread * life;
 
-	Stack<int>::NodePool pool;
+	// shared by every tester
+	Stack<int>::NodePool * pool;
 
 	public:
 
-	Tester() : pool(TEST_OPS)
-	{
-	}
-
-	void start(Stack<int> * _stack)
+	void start(Stack<int> * _stack, Stack<int>::NodePool * _pool)
 	{
 		stack = _stack;
+		pool = _pool;
 		life = new std::thread(&Tester::run, this);
 	}
 
@@ -190,12 +189,13 @@ struct Tester
 			if (q == 0)
 			{
 				// push node
-				stack->push(pool.get(std::rand()));
+				stack->push(pool->get(std::rand()));
 			}
 			else if (q == 2)
 			{
-				// pop node
+				// pop node, and give it back (the tag covers stale readers)
 				auto node = stack->pop();
+				if (node != nullptr) pool->put(node);
 			}
 			else
 			{
@@ -217,36 +217,52 @@ struct Tester
 	}
 };
 
-void populate(Stack<int> & stack, Stack<int>::NodePool & pool)
+void populate(Stack<int> & stack, Stack<int>::NodePool & pool, int count)
 {
-	Stack<int>::Node * node; 
-	while ((node = pool.get(std::rand())) != nullptr)
-		stack.push(node);
+	for (int i = 0; i < count; i++)
+		stack.push(pool.get(std::rand()));
 }
 
 void test()
 {
+	using namespace std::chrono;
+
 	std::srand(std::time(nullptr));
 
+	Stack<int>::NodePool pool;
 	Stack<int> stack;
-	Tester testers[4];
+	Tester * testers = new Tester[THREAD_COUNT];
 
 	printf("Pre-Populating...\n");
-	Stack<int>::NodePool prepopPool(50'000);
-	populate(stack, prepopPool);
+	populate(stack, pool, 50'000);
+	long prepopulated = pool.allocated();
 
 	printf("Launching threads...\n");
-	for (int i = 0; i < 4; i++)
-		testers[i].start(&stack);
+	auto start_time = steady_clock::now();
+
+	for (int i = 0; i < THREAD_COUNT; i++)
+		testers[i].start(&stack, &pool);
 
-	for (int i = 0; i < 4; i++)
+	for (int i = 0; i < THREAD_COUNT; i++)
 		testers[i].join();
 
+	auto stop_time = steady_clock::now();
+
 	printf("%d operations completed\n", stack.getOpCount());
+	printf("%ld push / pop pairs eliminated\n", stack.getEliminated());
+	printf("%ld nodes allocated (%ld while running)\n", pool.allocated(),
+			pool.allocated() - prepopulated);
+	printf("Execution time: %.3fms\n",
+			duration_cast<nanoseconds>(stop_time - start_time).count() / 1e6);
+
+	delete [] testers;
 }
 
-int main()
+int main(int argc, char ** argv)
 {
+	if (argc > 1)
+		THREAD_COUNT = atoi(argv[1]);
+
 	test();
 	return 0;
 }
@@ -1,81 +1,360 @@
 #include <atomic>
+#include <chrono>
 #include <memory>
 #include <thread>
+#include <vector>
 
+#include <cstdint>
 #include <cstdio>  // printf()
 #include <cstdlib> // rand();
+#include <cstring>
 #include <ctime>   // to seed rand();
 
-template <class T>
-class Stack
+#include "elimination.h"
+#include "nodepool.h"
+
+/*
+ * The stack below hands its head to a reclamation policy, each of which
+ * makes pop() safe against ABA when nodes are recycled:
+ *
+ *   TaggedHead     head pointer + counter swapped with a 128-bit CAS, so a
+ *                  node that was popped and pushed back no longer matches
+ *   HazardPointers a popper publishes the head it is about to dereference,
+ *                  retired nodes are only handed back once nobody has
+ *   EpochBased     poppers announce the global epoch, retired nodes are
+ *                  handed back two epochs later
+ *
+ * Every policy exposes try_push(), try_pop(), pop_all() and retire(node,
+ * reusable). try_push() puts a linked chain on in one attempt, try_pop()
+ * takes up to n nodes off in one, the stack retries them with an
+ * elimination array in between. Once a popped node is done with it is
+ * retired, and ends up in [reusable] (right away or on a later call) when
+ * it is safe to push again.
+ *
+ * Taking n nodes only reads past the head, and nothing below a head changes
+ * while it stays the head: the tag, the hazard on it or the epoch we're in
+ * make sure it did if the CAS succeeds.
+ */
+
+/*
+ * the last of up to [n] nodes from [first] on (stale reads may end it
+ * early, the caller's CAS fails then anyway)
+ */
+template <class Node>
+Node * chain_end(Node * first, size_t n)
+{
+	Node * last = first;
+	for (size_t i = 1; i < n; i++)
+	{
+		Node * next = __atomic_load_n(&last->next, __ATOMIC_RELAXED);
+		if (next == nullptr) break;
+		last = next;
+	}
+
+	return last;
+}
+
+template <class Node>
+class TaggedHead
 {
+	// every successful swap bumps the tag
+	struct alignas(16) Head
+	{
+		Node * ptr;
+		uintptr_t tag;
+	};
+
+	Head head;
+
+	/* lock cmpxchg16b, [expected] is refreshed on failure */
+	static bool cas(Head * target, Head & expected, Head desired)
+	{
+		bool ok;
+		__asm__ __volatile__("lock cmpxchg16b %1"
+				: "=@ccz" (ok), "+m" (*target), "+a" (expected.ptr), "+d" (expected.tag)
+				: "b" (desired.ptr), "c" (desired.tag)
+				: "memory");
+		return ok;
+	}
+
+	/* the two halves may tear, which only makes the next CAS fail */
+	Head load() const
+	{
+		Head h;
+		h.tag = __atomic_load_n(&head.tag, __ATOMIC_ACQUIRE);
+		h.ptr = __atomic_load_n(&head.ptr, __ATOMIC_ACQUIRE);
+		return h;
+	}
+
 	public:
 
-	struct Node
+	TaggedHead() : head { nullptr, 0 }
 	{
-		T val;
-		Node * next;
+	}
 
-		Node()
-		{
-		}
+	/* [first] ... [last] already linked */
+	bool try_push(Node * first, Node * last)
+	{
+		Head cur = load();
+		__atomic_store_n(&last->next, cur.ptr, __ATOMIC_RELAXED);
+		return cas(&head, cur, { first, cur.tag + 1 });
+	}
 
-		Node(T _val)
+	/*
+	 * false if it lost the race, otherwise [popped] is a nullptr terminated
+	 * chain of up to [n] nodes (or nullptr)
+	 */
+	bool try_pop(size_t n, Node *& popped)
+	{
+		Head cur = load();
+		popped = cur.ptr;
+		if (cur.ptr == nullptr) return true;
+
+		// the nodes may have been popped and reused meanwhile, their memory
+		// stays a Node though (the pool only recycles it), and then the
+		// tag won't match
+		Node * last = chain_end(cur.ptr, n);
+		Node * next = __atomic_load_n(&last->next, __ATOMIC_RELAXED);
+		if (!cas(&head, cur, { next, cur.tag + 1 })) return false;
+
+		__atomic_store_n(&last->next, nullptr, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	Node * pop_all()
+	{
+		Head cur = load();
+		while (cur.ptr != nullptr && !cas(&head, cur, { nullptr, cur.tag + 1 }));
+		return cur.ptr;
+	}
+
+	void retire(Node * node, std::vector<Node *> & reusable)
+	{
+		reusable.push_back(node);
+	}
+};
+
+template <class Node>
+class HazardPointers
+{
+	// retired nodes a thread collects before scanning the hazards
+	static const size_t SCAN_THRESHOLD = 2 * MAX_THREADS;
+
+	struct alignas(64) Slot
+	{
+		std::atomic<Node *> hazard { nullptr };
+		std::vector<Node *> retired;
+	};
+
+	std::atomic<Node *> head;
+	Slot slots[MAX_THREADS];
+
+	public:
+
+	HazardPointers() : head(nullptr)
+	{
+	}
+
+	bool try_push(Node * first, Node * last)
+	{
+		Node * cur = head.load(std::memory_order_relaxed);
+		__atomic_store_n(&last->next, cur, __ATOMIC_RELAXED);
+		return head.compare_exchange_strong(cur, first,
+				std::memory_order_release, std::memory_order_relaxed);
+	}
+
+	bool try_pop(size_t n, Node *& popped)
+	{
+		std::atomic<Node *> & hazard = slots[ThreadSlot::get()].hazard;
+
+		Node * cur = head.load(std::memory_order_acquire);
+		popped = cur;
+		if (cur == nullptr) return true;
+
+		// publish, then make sure it was still the head afterwards. The
+		// hazard keeps it from coming back, so if it's still the head at the
+		// CAS it has been all along
+		hazard.store(cur);
+		Node * last = nullptr;
+		bool ok = head.load() == cur && (last = chain_end(cur, n),
+				head.compare_exchange_strong(cur, __atomic_load_n(&last->next, __ATOMIC_RELAXED)));
+
+		hazard.store(nullptr, std::memory_order_release);
+
+		if (ok) __atomic_store_n(&last->next, nullptr, __ATOMIC_RELAXED);
+		return ok;
+	}
+
+	/* nothing is dereferenced, no hazard needed */
+	Node * pop_all()
+	{
+		return head.exchange(nullptr, std::memory_order_acquire);
+	}
+
+	void retire(Node * node, std::vector<Node *> & reusable)
+	{
+		std::vector<Node *> & retired = slots[ThreadSlot::get()].retired;
+		retired.push_back(node);
+		if (retired.size() < SCAN_THRESHOLD) return;
+
+		std::vector<Node *> hazards;
+		for (Slot & s : slots)
 		{
-			val = _val;
+			if (Node * h = s.hazard.load()) hazards.push_back(h);
 		}
 
-		~Node()
+		size_t kept = 0;
+		for (Node * n : retired)
 		{
-			//printf("Node destroyed.\n");
+			bool in_use = false;
+			for (Node * h : hazards)
+				in_use = in_use || h == n;
+
+			if (in_use) retired[kept++] = n;
+			else reusable.push_back(n);
 		}
+		retired.resize(kept);
+	}
+};
+
+template <class Node>
+class EpochBased
+{
+	// a thread tries to move the epoch on every this many retires
+	static const int ADVANCE_EVERY = 64;
+
+	struct alignas(64) Slot
+	{
+		std::atomic<bool> active { false };
+		std::atomic<uint64_t> epoch { 0 };
+
+		// nodes retired in epoch limbo_epoch[e % 3] = e
+		std::vector<Node *> limbo[3];
+		uint64_t limbo_epoch[3] = { 0, 0, 0 };
+		int retires = 0;
 	};
 
+	std::atomic<Node *> head;
+	std::atomic<uint64_t> global_epoch;
+	Slot slots[MAX_THREADS];
+
+	public:
+
+	EpochBased() : head(nullptr), global_epoch(0)
+	{
+	}
 
-	class NodePool
+	bool try_push(Node * first, Node * last)
 	{
-		int size;
-		Node * pool;
+		Node * cur = head.load(std::memory_order_relaxed);
+		__atomic_store_n(&last->next, cur, __ATOMIC_RELAXED);
+		return head.compare_exchange_strong(cur, first,
+				std::memory_order_release, std::memory_order_relaxed);
+	}
 
-		int used;
+	bool try_pop(size_t n, Node *& popped)
+	{
+		Slot & slot = slots[ThreadSlot::get()];
 
-		public:
+		// announce the epoch we read nodes in
+		slot.active.store(true);
+		slot.epoch.store(global_epoch.load());
+		std::atomic_thread_fence(std::memory_order_seq_cst);
 
-		NodePool(int _size)
+		Node * cur = head.load(std::memory_order_acquire);
+		popped = cur;
+		Node * last = nullptr;
+		bool ok = cur == nullptr || (last = chain_end(cur, n),
+				head.compare_exchange_strong(cur, __atomic_load_n(&last->next, __ATOMIC_RELAXED)));
+
+		slot.active.store(false, std::memory_order_release);
+
+		if (ok && last != nullptr) __atomic_store_n(&last->next, nullptr, __ATOMIC_RELAXED);
+		return ok;
+	}
+
+	Node * pop_all()
+	{
+		return head.exchange(nullptr, std::memory_order_acquire);
+	}
+
+	void retire(Node * node, std::vector<Node *> & reusable)
+	{
+		Slot & slot = slots[ThreadSlot::get()];
+
+		uint64_t epoch = global_epoch.load();
+
+		// nothing retired two or more epochs ago can still be read
+		for (int b = 0; b < 3; b++)
 		{
-			used = 0;
-			size = _size;
-			pool = new Node[size];
+			if (slot.limbo_epoch[b] + 2 > epoch) continue;
+
+			reusable.insert(reusable.end(), slot.limbo[b].begin(), slot.limbo[b].end());
+			slot.limbo[b].clear();
 		}
 
-		Node * get(int val)
+		// (a bucket that was due got emptied above)
+		slot.limbo_epoch[epoch % 3] = epoch;
+		slot.limbo[epoch % 3].push_back(node);
+
+		if (++slot.retires % ADVANCE_EVERY == 0) try_advance(epoch);
+	}
+
+	private:
+
+	/* move to the next epoch once every active thread has caught up */
+	void try_advance(uint64_t epoch)
+	{
+		for (Slot & s : slots)
 		{
-			if (used >= size) return nullptr;
+			if (s.active.load() && s.epoch.load() != epoch) return;
+		}
 
-			Node * node = pool + used;
-			used++;
+		global_epoch.compare_exchange_strong(epoch, epoch + 1);
+	}
+};
 
-			node->val = val;
+template <class T, template <class> class Reclaim = TaggedHead>
+class Stack
+{
+	public:
 
-			return node;
+	// a line each, threads pushing neighbours don't share one
+	struct alignas(64) Node
+	{
+		T val;
+		Node * next;
+
+		Node()
+		{
+		}
+
+		Node(T _val)
+		{
+			val = _val;
 		}
 
-		~NodePool()
+		~Node()
 		{
-			delete [] pool;
+			//printf("Node destroyed.\n");
 		}
 	};
 
+
+	typedef ::NodePool<Node> NodePool;
+
 	private:
 
-	std::atomic<Node*> head;
+	Reclaim<Node> head;
 	std::atomic<int> numOps;
 
+	// where a push and a pop that lost the race for the head can meet instead
+	EliminationArray<Node> elimination;
+
 	public:
 
 	Stack()
 	{
-		head = nullptr;
 		numOps = 0;
 	}
 
@@ -84,12 +363,8 @@ class Stack
 	{
 		if (newNode == nullptr) return false;
 
-		bool succ;
-		do
-		{
-			newNode->next = head;
-			succ = head.compare_exchange_strong(newNode->next, newNode);
-		} while (!succ);
+		// contended, hand it straight to a pop if one comes by
+		while (!head.try_push(newNode, newNode) && !elimination.push(newNode));
 
 		++numOps;
 		return true;
@@ -98,70 +373,191 @@ class Stack
 	// returns node (don't handle node destruction)
 	Node * pop()
 	{
+		// contended, take a node a push is offering if there is one
 		Node * popped;
-		bool succ;
-		do
+		while (!head.try_pop(1, popped) && (popped = elimination.pop()) == nullptr);
+
+		if (popped == nullptr)
+			return nullptr;
+
+		++numOps;
+		return popped;
+	}
+
+	/*
+	 * pushes the nodes in [first, last) with a single CAS, linked up front.
+	 * They come off in the same order, *first on top. nullptrs are skipped
+	 */
+	template <class It>
+	int push_many(It first, It last)
+	{
+		Node * top = nullptr;
+		Node * bottom = nullptr;
+		int count = 0;
+
+		for (; first != last; ++first)
 		{
-			popped = head;
+			Node * node = *first;
+			if (node == nullptr) continue;
+
+			if (bottom == nullptr) top = node;
+			else bottom->next = node;
 
-			if (popped == nullptr) 
-				return nullptr;
+			bottom = node;
+			count++;
+		}
 
-			Node * newHead = popped->next;
+		if (count == 0) return 0;
 
-			succ = head.compare_exchange_strong(popped, newHead);
-		} while(!succ);
+		while (!head.try_push(top, bottom));
 
-		++numOps;
+		numOps += count;
+		return count;
+	}
+
+	/* up to [n] nodes with a single CAS, as a nullptr terminated chain */
+	Node * pop_many(size_t n)
+	{
+		if (n == 0) return nullptr;
+
+		Node * popped;
+		while (!head.try_pop(n, popped));
+
+		numOps += length(popped);
 		return popped;
 	}
 
+	/* the whole stack, with a single CAS */
+	Node * pop_all()
+	{
+		Node * popped = head.pop_all();
+
+		numOps += length(popped);
+		return popped;
+	}
+
+	/* done with a popped node, it shows up in [reusable] once it's safe to push again */
+	void retire(Node * node, std::vector<Node *> & reusable)
+	{
+		head.retire(node, reusable);
+	}
+
 	int getOpCount()
 	{
 		return (int) numOps;
 	}
 
+	long getEliminated() const
+	{
+		return elimination.getEliminated();
+	}
+
 	~Stack()
 	{
-		while (pop() != nullptr);
+		pop_all();
+	}
+
+	private:
+
+	static int length(Node * chain)
+	{
+		int count = 0;
+		for (; chain != nullptr; chain = chain->next)
+			count++;
+
+		return count;
 	}
 
 };
 
 const int TEST_OPS = 150'000;
 
+// every BURST_EVERY-th operation moves BURST nodes at once instead
+const int BURST_EVERY = 32;
+const int BURST = 16;
+
+int THREAD_COUNT = 4;
+
+template <template <class> class Reclaim>
 struct Tester
 {
-	Stack<int> * stack;
+	typedef Stack<int, Reclaim> TestStack;
+
+	TestStack * stack;
 	std::thread * life;
 
-	Stack<int>::NodePool pool;
+	// shared by every tester
+	typename TestStack::NodePool * pool;
+
+	// popped nodes that are safe to give back to the pool
+	std::vector<typename TestStack::Node *> reusable;
+
+	long pushes = 0;
+	long pops = 0;
 
 	public:
 
-	Tester() : pool(TEST_OPS)
+	void start(TestStack * _stack, typename TestStack::NodePool * _pool)
+	{
+		stack = _stack;
+		pool = _pool;
+		life = new std::thread(&Tester::run, this);
+	}
+
+	typename TestStack::Node * next_node()
 	{
+		return pool->get(std::rand());
 	}
 
-	void start(Stack<int> * _stack)
+	/* done with a popped node, back to the pool once nobody can read it */
+	void recycle(typename TestStack::Node * node)
 	{
-		stack = _stack;
-		life = new std::thread(&Tester::run, this);
+		stack->retire(node, reusable);
+
+		for (auto n : reusable)
+			pool->put(n);
+		reusable.clear();
 	}
 
 	void run()
 	{
 		for (int i = 0; i < TEST_OPS; i++)
 		{
-			if (std::rand() % 2 == 0)
+			if (i % BURST_EVERY == 0)
+			{
+				// bursts alternate between push_many and pop_many
+				if (i / BURST_EVERY % 2 == 0)
+				{
+					typename TestStack::Node * burst[BURST];
+					for (auto & node : burst)
+						node = next_node();
+
+					pushes += stack->push_many(burst, burst + BURST);
+				}
+				else
+				{
+					for (auto node = stack->pop_many(BURST); node != nullptr; )
+					{
+						auto next = node->next;
+
+						pops++;
+						recycle(node);
+						node = next;
+					}
+				}
+			}
+			else if (std::rand() % 2 == 0)
 			{
-				// push node
-				stack->push(pool.get(std::rand()));
+				pushes += stack->push(next_node());
 			}
 			else
 			{
-				// pop node
+				// pop node, and hand it back for reuse
 				auto node = stack->pop();
+				if (node == nullptr) continue;
+
+				pops++;
+				recycle(node);
 			}
 		}
 	}
@@ -179,36 +575,80 @@ struct Tester
 	}
 };
 
-void populate(Stack<int> & stack, Stack<int>::NodePool & pool)
+template <template <class> class Reclaim>
+long populate(Stack<int, Reclaim> & stack, typename Stack<int, Reclaim>::NodePool & pool,
+		int count)
 {
-	Stack<int>::Node * node; 
-	while ((node = pool.get(std::rand())) != nullptr)
-		stack.push(node);
+	long pushed = 0;
+	for (int i = 0; i < count; i++)
+		pushed += stack.push(pool.get(std::rand()));
+
+	return pushed;
 }
 
-void test()
+template <template <class> class Reclaim>
+void test(const char * name)
 {
+	using namespace std::chrono;
+
 	std::srand(std::time(nullptr));
 
-	Stack<int> stack;
-	Tester testers[4];
+	typename Stack<int, Reclaim>::NodePool pool;
+	Stack<int, Reclaim> stack;
+	Tester<Reclaim> * testers = new Tester<Reclaim>[THREAD_COUNT];
 
-	printf("Populating...\n");
-	Stack<int>::NodePool prepopPool(50'000);
-	populate(stack, prepopPool);
+	printf("Populating (%s)...\n", name);
+	long expected = populate(stack, pool, 50'000);
+	long prepopulated = pool.allocated();
 
 	printf("Launching threads...\n");
-	for (int i = 0; i < 4; i++)
-		testers[i].start(&stack);
+	auto start_time = steady_clock::now();
 
-	for (int i = 0; i < 4; i++)
+	for (int i = 0; i < THREAD_COUNT; i++)
+		testers[i].start(&stack, &pool);
+
+	for (int i = 0; i < THREAD_COUNT; i++)
 		testers[i].join();
 
+	auto stop_time = steady_clock::now();
+
 	printf("%d operations completed\n", stack.getOpCount());
+	printf("%ld push / pop pairs eliminated\n", stack.getEliminated());
+	printf("%ld nodes allocated (%ld while running)\n", pool.allocated(),
+			pool.allocated() - prepopulated);
+	printf("Execution time: %.3fms\n",
+			duration_cast<nanoseconds>(stop_time - start_time).count() / 1e6);
+
+	// an ABA hit loses or duplicates nodes, so the count stops adding up
+	for (int i = 0; i < THREAD_COUNT; i++)
+		expected += testers[i].pushes - testers[i].pops;
+
+	// count what is left, all taken off at once
+	long left = 0;
+	for (auto node = stack.pop_all(); node != nullptr && left <= expected; node = node->next)
+		left++;
+
+	printf("Stack consistent: %s (%ld nodes left, %ld expected)\n",
+			left == expected ? "yes" : "NO", left, expected);
+
+	delete [] testers;
 }
 
-int main()
+int main(int argc, char ** argv)
 {
-	test();
+	if (argc > 1)
+		THREAD_COUNT = atoi(argv[1]);
+
+	const char * policy = argc > 2 ? argv[2] : "tagged";
+
+	if (strcmp(policy, "tagged") == 0) test<TaggedHead>(policy);
+	else if (strcmp(policy, "hazard") == 0) test<HazardPointers>(policy);
+	else if (strcmp(policy, "epoch") == 0) test<EpochBased>(policy);
+	else
+	{
+		printf("usage: %s [thread_count] [tagged|hazard|epoch]\n", argv[0]);
+		return 1;
+	}
+
 	return 0;
 }
@@ -0,0 +1,219 @@
+#ifndef TRIAL_H
+#define TRIAL_H
+
+#include <vector>
+
+#include <cstdint>
+
+#include <immintrin.h>
+
+typedef unsigned long int prime_t;
+
+/*
+ * batched trial division for odd candidates below 2^32.
+ *
+ * Every divisor d keeps Lemire's fastmod reciprocal M = (2^64 - 1) / d + 1,
+ * with which d | n exactly when n * M (mod 2^64) <= M - 1: one multiply and
+ * a compare instead of a 64-bit division. A batch of BATCH_SIZE candidates
+ * is tested against each divisor at once with AVX-512 or AVX2, whichever
+ * the cpu supports (checked at runtime), or plain scalar code.
+ *
+ * The divisors must cover the square root of every candidate.
+ */
+class BatchTrial
+{
+	public:
+
+	static const int BATCH_SIZE = 16;
+
+	enum Kernel { SCALAR, AVX2, AVX512, KERNEL_COUNT };
+
+	private:
+
+	std::vector<uint64_t> divisors;
+	std::vector<uint64_t> inverses;
+
+	Kernel kernel;
+
+	public:
+
+	BatchTrial(const std::vector<prime_t> & primes)
+	{
+		for (prime_t p : primes)
+		{
+			if (p == 2) continue;
+
+			divisors.push_back(p);
+			inverses.push_back(UINT64_MAX / p + 1);
+		}
+
+		kernel = best_kernel();
+	}
+
+	static Kernel best_kernel()
+	{
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+			return AVX512;
+		if (__builtin_cpu_supports("avx2"))
+			return AVX2;
+
+		return SCALAR;
+	}
+
+	static const char * kernel_name(Kernel k)
+	{
+		const char * names[] = { "scalar", "avx2", "avx512" };
+		return names[k];
+	}
+
+	/* force a kernel (for benchmarking), false if the cpu can't run it */
+	bool set_kernel(Kernel k)
+	{
+		if (k > best_kernel()) return false;
+
+		kernel = k;
+		return true;
+	}
+
+	Kernel get_kernel() const { return kernel; }
+
+	/*
+	 * is_prime[i] = candidates[i] has no divisor other than itself, for up
+	 * to BATCH_SIZE odd candidates in [3, 2^32)
+	 */
+	void test(const prime_t * candidates, int count, bool * is_prime) const
+	{
+		// pad with 0, which every divisor divides
+		uint64_t n[BATCH_SIZE] = { 0 };
+		uint64_t max = 0;
+		for (int i = 0; i < count; i++)
+		{
+			n[i] = candidates[i];
+			if (n[i] > max) max = n[i];
+		}
+
+		// no divisor past sqrt(max) can matter
+		size_t limit = 0;
+		while (limit < divisors.size() && divisors[limit] * divisors[limit] <= max)
+			limit++;
+
+		uint32_t composite;
+		switch (kernel)
+		{
+			case AVX512: composite = test_avx512(n, limit); break;
+			case AVX2: composite = test_avx2(n, limit); break;
+			default: composite = test_scalar(n, limit); break;
+		}
+
+		for (int i = 0; i < count; i++)
+			is_prime[i] = !(composite >> i & 1);
+	}
+
+	private:
+
+	// all return a bitmask of the lanes found to be composite
+
+	uint32_t test_scalar(const uint64_t * n, size_t limit) const
+	{
+		const uint32_t all = (1u << BATCH_SIZE) - 1;
+
+		uint32_t composite = 0;
+		for (size_t k = 0; k < limit && composite != all; k++)
+		{
+			uint64_t d = divisors[k];
+			uint64_t m = inverses[k];
+
+			for (int i = 0; i < BATCH_SIZE; i++)
+			{
+				if (n[i] * m <= m - 1 && n[i] != d)
+					composite |= 1u << i;
+			}
+		}
+
+		return composite;
+	}
+
+	__attribute__((target("avx2")))
+	uint32_t test_avx2(const uint64_t * n, size_t limit) const
+	{
+		const int LANES = 4;
+		const int VECTORS = BATCH_SIZE / LANES;
+
+		// there is no unsigned 64-bit compare, flip the sign bits instead
+		const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+		const __m256i ones = _mm256_set1_epi64x(-1);
+
+		__m256i v[VECTORS];
+		__m256i composite[VECTORS];
+		for (int j = 0; j < VECTORS; j++)
+		{
+			v[j] = _mm256_loadu_si256((const __m256i *) (n + j * LANES));
+			composite[j] = _mm256_setzero_si256();
+		}
+
+		for (size_t k = 0; k < limit; k++)
+		{
+			uint64_t m = inverses[k];
+			__m256i d = _mm256_set1_epi64x(divisors[k]);
+			__m256i m_lo = _mm256_set1_epi64x(m & 0xffffffff);
+			__m256i m_hi = _mm256_set1_epi64x(m >> 32);
+			__m256i bound = _mm256_xor_si256(_mm256_set1_epi64x(m - 1), sign);
+
+			__m256i all = ones;
+			for (int j = 0; j < VECTORS; j++)
+			{
+				// n < 2^32, so n * m = n * m_lo + (n * m_hi << 32)
+				__m256i lo = _mm256_mul_epu32(v[j], m_lo);
+				__m256i hi = _mm256_mul_epu32(v[j], m_hi);
+				__m256i product = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+
+				__m256i above = _mm256_cmpgt_epi64(
+						_mm256_xor_si256(product, sign), bound);
+				__m256i self = _mm256_cmpeq_epi64(v[j], d);
+
+				composite[j] = _mm256_or_si256(composite[j],
+						_mm256_andnot_si256(_mm256_or_si256(above, self), ones));
+				all = _mm256_and_si256(all, composite[j]);
+			}
+
+			// every lane is already composite
+			if (_mm256_movemask_epi8(all) == -1) break;
+		}
+
+		uint32_t mask = 0;
+		for (int j = 0; j < VECTORS; j++)
+		{
+			uint32_t lanes = _mm256_movemask_pd(_mm256_castsi256_pd(composite[j]));
+			mask |= lanes << (j * LANES);
+		}
+
+		return mask;
+	}
+
+	__attribute__((target("avx512f,avx512dq")))
+	uint32_t test_avx512(const uint64_t * n, size_t limit) const
+	{
+		__m512i v0 = _mm512_loadu_si512(n);
+		__m512i v1 = _mm512_loadu_si512(n + 8);
+
+		__mmask8 c0 = 0;
+		__mmask8 c1 = 0;
+
+		for (size_t k = 0; k < limit && (c0 & c1) != 0xff; k++)
+		{
+			__m512i d = _mm512_set1_epi64(divisors[k]);
+			__m512i m = _mm512_set1_epi64(inverses[k]);
+			__m512i bound = _mm512_set1_epi64(inverses[k] - 1);
+
+			c0 |= _mm512_cmple_epu64_mask(_mm512_mullo_epi64(v0, m), bound)
+				& _mm512_cmpneq_epu64_mask(v0, d);
+			c1 |= _mm512_cmple_epu64_mask(_mm512_mullo_epi64(v1, m), bound)
+				& _mm512_cmpneq_epu64_mask(v1, d);
+		}
+
+		return c0 | (uint32_t) c1 << 8;
+	}
+};
+
+#endif
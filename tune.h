@@ -0,0 +1,210 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <unistd.h>
+
+typedef unsigned long int prime_t;
+
+/* what the tuner picks */
+struct Tuning
+{
+	int threads;
+	prime_t segment_size; // integers
+};
+
+/*
+ * picks a thread count and segment size for the host it runs on.
+ *
+ * The host is probed once (cpus we may run on, cache sizes, NUMA nodes),
+ * then short calibration runs supplied by the caller decide: first the
+ * segment size at one thread per cpu, then the thread count at that
+ * segment size. Results are kept in a small text file, one line per key
+ * (e.g. the sieve mode), and only reused on a host that probes the same.
+ */
+class Autotuner
+{
+	int cpus;
+	long l1;
+	long l2;
+	long l3;
+	int nodes;
+
+	public:
+
+	Autotuner()
+	{
+		cpus = std::max(1u, std::thread::hardware_concurrency());
+
+		// 0 when the libc can't tell
+		l1 = std::max(0L, sysconf(_SC_LEVEL1_DCACHE_SIZE));
+		l2 = std::max(0L, sysconf(_SC_LEVEL2_CACHE_SIZE));
+		l3 = std::max(0L, sysconf(_SC_LEVEL3_CACHE_SIZE));
+
+		nodes = 0;
+		if (DIR * dir = opendir("/sys/devices/system/node"))
+		{
+			while (dirent * entry = readdir(dir))
+			{
+				int id;
+				if (sscanf(entry->d_name, "node%d", &id) == 1) nodes++;
+			}
+			closedir(dir);
+		}
+		nodes = std::max(nodes, 1);
+	}
+
+	int get_cpus() const { return cpus; }
+
+	void report() const
+	{
+		printf("Host: %d cpus, L1d %ldK, L2 %ldK, L3 %ldK, %d NUMA node%s\n",
+				cpus, l1 / 1024, l2 / 1024, l3 / 1024, nodes, nodes > 1 ? "s" : "");
+	}
+
+	/* the stored tuning for [key], if it was made on a host like this one */
+	bool load(const char * path, const char * key, Tuning & tuning) const
+	{
+		FILE * file = fopen(path, "r");
+		if (file == nullptr) return false;
+
+		bool found = false;
+		char line[256];
+		while (!found && fgets(line, sizeof(line), file))
+		{
+			char name[64];
+			Tuning t;
+			if (sscanf(line, "%63s %d %lu", name, &t.threads, &t.segment_size) == 3
+					&& strcmp(name, key) == 0
+					&& strcmp(host_part(line).c_str(), signature().c_str()) == 0)
+			{
+				tuning = t;
+				found = true;
+			}
+		}
+
+		fclose(file);
+		return found;
+	}
+
+	/* store [tuning] under [key], replacing any older line for it */
+	bool save(const char * path, const char * key, const Tuning & tuning) const
+	{
+		std::vector<std::string> lines;
+
+		if (FILE * file = fopen(path, "r"))
+		{
+			char line[256];
+			while (fgets(line, sizeof(line), file))
+			{
+				char name[64];
+				if (sscanf(line, "%63s", name) == 1 && strcmp(name, key) != 0)
+					lines.push_back(line);
+			}
+			fclose(file);
+		}
+
+		char line[256];
+		snprintf(line, sizeof(line), "%s %d %lu %s\n", key, tuning.threads,
+				tuning.segment_size, signature().c_str());
+		lines.push_back(line);
+
+		FILE * file = fopen(path, "w");
+		if (file == nullptr) return false;
+
+		for (const std::string & l : lines)
+			fputs(l.c_str(), file);
+
+		return fclose(file) == 0;
+	}
+
+	/*
+	 * search with [measure](threads, segment_size), which returns the time
+	 * of one calibration run (lower is better). Segments stay at or below
+	 * [max_segment], 0 leaves the segment size out of the search
+	 */
+	template <class F>
+	Tuning calibrate(F measure, prime_t max_segment) const
+	{
+		// the slice of an odd-only bitmap a segment covers is segment / 16
+		// bytes, try fitting it in L1, L2, and a share of L3
+		std::vector<prime_t> segments;
+		for (long bytes : { l1, l2 / 2, l2, l3 / cpus })
+		{
+			if (bytes > 0) segments.push_back(std::min<prime_t>(bytes * 16, max_segment));
+		}
+		if (segments.empty()) segments = { std::min<prime_t>(512 * 1024, max_segment) };
+
+		std::sort(segments.begin(), segments.end());
+		segments.erase(std::unique(segments.begin(), segments.end()), segments.end());
+
+		std::vector<int> thread_counts;
+		for (int t = 1; t < cpus; t *= 2)
+			thread_counts.push_back(t);
+		thread_counts.push_back(cpus);
+
+		Tuning best = { cpus, segments.front() };
+		double best_time = -1;
+
+		// a single candidate (or none, at max_segment 0) needs no search
+		for (size_t i = 0; i < segments.size() && segments.size() > 1; i++)
+			try_one(measure, cpus, segments[i], best, best_time);
+
+		for (int threads : thread_counts)
+			try_one(measure, threads, best.segment_size, best, best_time);
+
+		return best;
+	}
+
+	private:
+
+	template <class F>
+	void try_one(F & measure, int threads, prime_t segment, Tuning & best,
+			double & best_time) const
+	{
+		// best of two, the first run may still be faulting pages in
+		double time = std::min(measure(threads, segment), measure(threads, segment));
+		printf("  %3d threads, segment %8lu: %.2fms\n", threads, segment, time);
+
+		if (best_time < 0 || time < best_time)
+		{
+			best = { threads, segment };
+			best_time = time;
+		}
+	}
+
+	std::string signature() const
+	{
+		char s[128];
+		snprintf(s, sizeof(s), "%d %ld %ld %ld %d", cpus, l1, l2, l3, nodes);
+		return s;
+	}
+
+	/* the host fields of a stored line, past key, threads and segment */
+	static std::string host_part(const char * line)
+	{
+		std::string s(line);
+		size_t pos = 0;
+		for (int field = 0; field < 3 && pos != std::string::npos; field++)
+		{
+			pos = s.find_first_not_of(' ', pos);
+			pos = s.find(' ', pos);
+		}
+
+		if (pos == std::string::npos) return "";
+
+		s = s.substr(s.find_first_not_of(' ', pos));
+		while (!s.empty() && (s.back() == '\n' || s.back() == ' ')) s.pop_back();
+		return s;
+	}
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <algorithm>
+#include <vector>
+
+#include <cstring>
+
+#include "bitmap.h"
+
+/*
+ * wheel over the first few primes (modulus 2, 6, 30, 210, 2310, ...).
+ *
+ * In the odd-only bitmap the multiples of the odd wheel primes repeat every
+ * [period] = 3 * 5 * ... bits, so [period] whole words repeat exactly. That
+ * pattern is memcpy'd over a stretch of words before the real crossing off,
+ * which then only has to start past the wheel primes.
+ *
+ * The numbers coprime to the modulus (the spokes) are also exposed, for
+ * walking candidates in trial division.
+ */
+class Wheel
+{
+	prime_t modulus;
+	prime_t period;
+
+	std::vector<prime_t> primes;
+	std::vector<uint64_t> pattern;
+
+	std::vector<prime_t> spokes;
+	std::vector<prime_t> gaps;
+
+	public:
+
+	Wheel(prime_t _modulus)
+	{
+		modulus = _modulus;
+		period = 1;
+
+		// the wheel primes are the prime factors of the modulus
+		prime_t rest = modulus;
+		for (prime_t p = 2; rest > 1; p++)
+		{
+			if (rest % p != 0) continue;
+
+			primes.push_back(p);
+			rest /= p;
+			if (p != 2) period *= p;
+		}
+
+		// --- Presieve pattern ------------------------------------------------
+		pattern.assign(period, 0);
+		for (prime_t w = 0; w < period; w++)
+		{
+			for (int b = 0; b < 64; b++)
+			{
+				prime_t n = w * OddBitmap::WORD_SPAN + 2 * b + 1;
+				for (prime_t p : primes)
+				{
+					if (p != 2 && n % p == 0)
+						pattern[w] |= uint64_t(1) << b;
+				}
+			}
+		}
+
+		// --- Spokes ----------------------------------------------------------
+		for (prime_t r = 1; r < modulus; r++)
+		{
+			bool coprime = true;
+			for (prime_t p : primes)
+				coprime = coprime && r % p != 0;
+
+			if (coprime) spokes.push_back(r);
+		}
+
+		for (size_t i = 0; i < spokes.size(); i++)
+		{
+			prime_t next = i + 1 < spokes.size() ?
+				spokes[i + 1] : modulus + spokes[0];
+			gaps.push_back(next - spokes[i]);
+		}
+	}
+
+	/* true for the primorials the wheel can be built from */
+	static bool valid(prime_t modulus)
+	{
+		const prime_t small[] = { 2, 3, 5, 7, 11, 13, 17 };
+
+		prime_t product = 1;
+		for (prime_t p : small)
+		{
+			product *= p;
+			if (product == modulus) return true;
+		}
+
+		return false;
+	}
+
+	/* true if multiples of [prime] are already covered by the pattern */
+	bool covers(prime_t prime) const
+	{
+		return modulus % prime == 0;
+	}
+
+	/*
+	 * overwrite [count] words of the bitmap starting at word [first] with the
+	 * presieve. The caller must own those words.
+	 */
+	void stamp(OddBitmap & bitmap, prime_t first, prime_t count) const
+	{
+		uint64_t * words = bitmap.data() + first;
+		bool last = first + count == bitmap.size();
+
+		prime_t offset = first % period;
+		for (prime_t left = count; left > 0;)
+		{
+			prime_t n = std::min(left, period - offset);
+			memcpy(words, pattern.data() + offset, n * sizeof(uint64_t));
+
+			words += n;
+			left -= n;
+			offset = 0;
+		}
+
+		if (first == 0 && count > 0)
+		{
+			// the wheel primes themselves are prime, but 1 isn't
+			for (prime_t p : primes)
+			{
+				if (p != 2) bitmap.data()[0] &= ~OddBitmap::bit(p);
+			}
+			bitmap.data()[0] |= OddBitmap::bit(1);
+		}
+
+		if (last) bitmap.mark_padding();
+	}
+
+	/* first number >= n that is coprime to the modulus, and its spoke */
+	prime_t first_candidate(prime_t n, size_t & spoke) const
+	{
+		prime_t base = n / modulus * modulus;
+		auto it = std::lower_bound(spokes.begin(), spokes.end(), n - base);
+		if (it == spokes.end())
+		{
+			base += modulus;
+			it = spokes.begin();
+		}
+
+		spoke = it - spokes.begin();
+		return base + *it;
+	}
+
+	/* candidate following [n], which must sit on [spoke] */
+	prime_t next_candidate(prime_t n, size_t & spoke) const
+	{
+		n += gaps[spoke];
+		if (++spoke == gaps.size()) spoke = 0;
+		return n;
+	}
+
+	prime_t get_modulus() const { return modulus; }
+	const std::vector<prime_t> & get_primes() const { return primes; }
+};
+
+#endif